@@ -24,38 +24,160 @@
 #define AHO_CORASICK_HPP
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cstdint>
+#include <cstring>
 #include <deque>
+#include <exception>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <queue>
 #include <utility>
 #include <vector>
 
+#include "case_folding.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// SSSE3 code is compiled with a target attribute and used if the CPU
+// supports it at run time.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AHO_CORASICK_HAS_SSSE3_TARGET 1
+#include <tmmintrin.h>
+#endif
+
 namespace aho_corasick {
-	
+
+	inline unsigned popcount(uint64_t x) {
+#if defined(__GNUC__)
+		return __builtin_popcountll(x);
+#else
+		x = x - ((x >> 1) & UINT64_C(0x5555555555555555));
+		x = (x & UINT64_C(0x3333333333333333)) + ((x >> 2) & UINT64_C(0x3333333333333333));
+		x = (x + (x >> 4)) & UINT64_C(0x0F0F0F0F0F0F0F0F);
+		return static_cast<unsigned>((x * UINT64_C(0x0101010101010101)) >> 56);
+#endif
+	}
+
+	// Undefined for zero.
+	inline unsigned count_trailing_zeros(unsigned x) {
+#if defined(__GNUC__)
+		return __builtin_ctz(x);
+#else
+		unsigned count = 0;
+		for (; !(x & 1); x >>= 1)
+			++count;
+		return count;
+#endif
+	}
+
+	inline unsigned count_trailing_zeros(uint64_t x) {
+#if defined(__GNUC__)
+		return __builtin_ctzll(x);
+#else
+		unsigned count = 0;
+		for (; !(x & 1); x >>= 1)
+			++count;
+		return count;
+#endif
+	}
+
+	// Deleter that destroys and deallocates an object with the allocator it was
+	// created with. The allocator type is exposed so that containers holding
+	// the owning pointers can allocate their nodes from the same source.
+	template <typename T, typename Allocator>
+	class allocator_deleter
+	{
+	public:
+		typedef typename std::allocator_traits<Allocator>::template rebind_alloc<T>	allocator_type;
+		typedef std::allocator_traits<allocator_type>								allocator_traits;
+
+	protected:
+		allocator_type d_alloc;
+
+	public:
+		allocator_deleter(): d_alloc() {}
+
+		allocator_deleter(const allocator_type& alloc): d_alloc(alloc) {}
+
+		template <typename... Args>
+		T* create(Args&&... args) {
+			T* ptr = allocator_traits::allocate(d_alloc, 1);
+			try {
+				allocator_traits::construct(d_alloc, ptr, std::forward<Args>(args)...);
+			} catch (...) {
+				allocator_traits::deallocate(d_alloc, ptr, 1);
+				throw;
+			}
+			return ptr;
+		}
+
+		void operator()(T* ptr) {
+			allocator_traits::destroy(d_alloc, ptr);
+			allocator_traits::deallocate(d_alloc, ptr, 1);
+		}
+
+		allocator_type get_allocator() const { return d_alloc; }
+	};
+
 	template <typename CharType, typename UniquePtr>
 	class transition_map
 	{
 	public:
-		typedef typename UniquePtr::pointer		ptr;
-		typedef std::map<CharType, UniquePtr>	map_type;
-		typedef typename map_type::size_type	size_type;
-		typedef std::vector<ptr>				state_collection;
-		typedef std::vector<CharType>			transition_collection;
+		typedef typename UniquePtr::pointer								ptr;
+		typedef typename UniquePtr::deleter_type::allocator_type		state_allocator_type;
+		typedef typename std::allocator_traits<state_allocator_type>::template rebind_alloc<
+			std::pair<const CharType, UniquePtr>
+		>																allocator_type;
+		typedef std::map<CharType, UniquePtr, std::less<CharType>, allocator_type>	map_type;
+		typedef typename map_type::size_type							size_type;
+		typedef std::vector<ptr>										state_collection;
+		typedef std::vector<CharType>									transition_collection;
 		
 	protected:
 		map_type d_map;
 		
 	public:
-		void set_transition(CharType character, ptr next)
+		transition_map(): d_map() {}
+
+		template <typename Allocator>
+		explicit transition_map(const Allocator& alloc)
+			: d_map(std::less<CharType>(), allocator_type(alloc)) {}
+
+		void set_transition(CharType character, UniquePtr next)
+		{
+			auto it = d_map.find(character);
+			if (it != d_map.end())
+				it->second = std::move(next);
+			else
+				d_map.emplace(character, std::move(next));
+		}
+
+		void erase_transition(CharType character)
+		{
+			d_map.erase(character);
+		}
+
+		// Add a transition on a character greater than any existing one.
+		void append_transition(CharType character, UniquePtr next)
 		{
-			d_map[character].reset(next);
+			assert(d_map.empty() || d_map.crbegin()->first < character);
+			d_map.emplace_hint(d_map.end(), character, std::move(next));
 		}
 		
+		allocator_type get_allocator() const { return d_map.get_allocator(); }
+		
 		size_type size() const { return d_map.size(); }
 		void freeze() {}
 		
@@ -75,6 +197,7 @@ namespace aho_corasick {
 			for (auto it = d_map.cbegin(); it != d_map.cend(); ++it) {
 				result.push_back(it->second.get());
 			}
+			return result;
 		}
 		
 		
@@ -83,10 +206,175 @@ namespace aho_corasick {
 			for (auto it = d_map.cbegin(); it != d_map.cend(); ++it) {
 				result.push_back(it->first);
 			}
+			return result;
 		}
 	};
 	
 
+	// Transition policy for large alphabets such as UTF-16 or UTF-32. The
+	// transitions of a state are kept in an open-addressing hash table with
+	// linear probing, so a lookup does not depend on the number of
+	// transitions, and a state with one transition takes one slot instead of
+	// a map node. The states and transitions are returned in character order.
+	template <typename CharType, typename UniquePtr>
+	class hashed_transition_map
+	{
+	public:
+		typedef typename UniquePtr::pointer								ptr;
+		typedef typename UniquePtr::deleter_type::allocator_type		state_allocator_type;
+		typedef size_t													size_type;
+		typedef std::vector<ptr>										state_collection;
+		typedef std::vector<CharType>									transition_collection;
+
+	private:
+		struct slot {
+			CharType  character;
+			UniquePtr next;                                  // Empty for a free slot.
+		};
+
+	public:
+		typedef typename std::allocator_traits<state_allocator_type>::template rebind_alloc<slot>	allocator_type;
+
+	protected:
+		std::vector<slot, allocator_type> d_slots;           // Size is zero or a power of two.
+		size_type                         d_size;
+
+	public:
+		hashed_transition_map(): d_slots(), d_size(0) {}
+
+		template <typename Allocator>
+		explicit hashed_transition_map(const Allocator& alloc)
+			: d_slots(allocator_type(alloc)), d_size(0) {}
+
+		void set_transition(CharType character, UniquePtr next)
+		{
+			auto const idx = find_slot(character);
+			if (idx != npos) {
+				d_slots[idx].next = std::move(next);
+				return;
+			}
+			if (max_load(d_slots.size()) < d_size + 1)
+				rehash(d_slots.empty() ? 1 : 2 * d_slots.size());
+			place(character, std::move(next));
+			++d_size;
+		}
+
+		void erase_transition(CharType character)
+		{
+			auto idx = find_slot(character);
+			if (idx == npos)
+				return;
+			d_slots[idx].next.reset();
+			--d_size;
+			// Move back the following entries whose probe sequence passes the
+			// freed slot, so that lookups do not need tombstones.
+			auto const mask = d_slots.size() - 1;
+			auto next = (idx + 1) & mask;
+			while (d_slots[next].next) {
+				auto const home = bucket(d_slots[next].character);
+				if (((next - home) & mask) >= ((next - idx) & mask)) {
+					d_slots[idx].character = d_slots[next].character;
+					d_slots[idx].next = std::move(d_slots[next].next);
+					idx = next;
+				}
+				next = (next + 1) & mask;
+			}
+		}
+
+		void append_transition(CharType character, UniquePtr next)
+		{
+			set_transition(character, std::move(next));
+		}
+
+		allocator_type get_allocator() const { return d_slots.get_allocator(); }
+
+		size_type size() const { return d_size; }
+		void freeze() {}
+
+		bool find(CharType character, ptr &result) const {
+			auto const idx = find_slot(character);
+			if (idx == npos)
+				return false;
+			result = d_slots[idx].next.get();
+			return true;
+		}
+
+		state_collection get_states() const {
+			state_collection result;
+			for (auto idx : sorted_slots())
+				result.push_back(d_slots[idx].next.get());
+			return result;
+		}
+
+		transition_collection get_transitions() const {
+			transition_collection result;
+			for (auto idx : sorted_slots())
+				result.push_back(d_slots[idx].character);
+			return result;
+		}
+
+	private:
+		static const size_type npos = ~size_type(0);
+
+		// Tables of up to two slots are filled completely, larger ones to 3/4.
+		static size_type max_load(size_type capacity) {
+			return (capacity <= 2 ? capacity : capacity / 4 * 3);
+		}
+
+		size_type bucket(CharType character) const {
+			auto const key = static_cast<uint64_t>(static_cast<typename std::make_unsigned<CharType>::type>(character));
+			return static_cast<size_type>((key * 0x9e3779b97f4a7c15ULL) >> 32) & (d_slots.size() - 1);
+		}
+
+		size_type find_slot(CharType character) const {
+			if (d_size == 0)
+				return npos;
+			// Small tables may have no free slot to end the probe sequence.
+			auto const mask = d_slots.size() - 1;
+			auto idx = bucket(character);
+			for (size_type probes = 0; probes < d_slots.size() && d_slots[idx].next; ++probes) {
+				if (d_slots[idx].character == character)
+					return idx;
+				idx = (idx + 1) & mask;
+			}
+			return npos;
+		}
+
+		void place(CharType character, UniquePtr next) {
+			auto const mask = d_slots.size() - 1;
+			auto idx = bucket(character);
+			while (d_slots[idx].next)
+				idx = (idx + 1) & mask;
+			d_slots[idx].character = character;
+			d_slots[idx].next = std::move(next);
+		}
+
+		void rehash(size_type capacity) {
+			typename UniquePtr::deleter_type const deleter{state_allocator_type(d_slots.get_allocator())};
+			std::vector<slot, allocator_type> old(d_slots.get_allocator());
+			old.reserve(capacity);
+			for (size_type idx = 0; idx < capacity; ++idx)
+				old.push_back(slot{CharType(), UniquePtr(nullptr, deleter)});
+			old.swap(d_slots);
+			for (auto& entry : old) {
+				if (entry.next)
+					place(entry.character, std::move(entry.next));
+			}
+		}
+
+		std::vector<size_type> sorted_slots() const {
+			std::vector<size_type> result;
+			for (size_type idx = 0; idx < d_slots.size(); ++idx) {
+				if (d_slots[idx].next)
+					result.push_back(idx);
+			}
+			std::sort(result.begin(), result.end(), [this](size_type a, size_type b) -> bool {
+				return d_slots[a].character < d_slots[b].character;
+			});
+			return result;
+		}
+	};
+
 	// class interval
 	class interval {
 		size_t d_start;
@@ -300,9 +588,9 @@ namespace aho_corasick {
 			: interval(interval::max_pos, interval::max_pos)
 			, d_keyword() {}
 
-		emit(size_t start, size_t end, string_type keyword, unsigned index)
+		emit(size_t start, size_t end, string_type keyword, unsigned index = 0)
 			: interval(start, end)
-			, d_keyword(keyword), d_index(index) {}
+			, d_keyword(std::move(keyword)), d_index(index) {}
 
 		string_type get_keyword() const { return string_type(d_keyword); }
 		unsigned get_index() const { return d_index; }
@@ -343,17 +631,80 @@ namespace aho_corasick {
 		emit_type get_emit() const { return d_emit; }
 	};
 
+	// Algorithms that parse_text may use instead of walking the automaton.
+	// All of them report the same emits. If the selected one does not
+	// support the keywords, character type, configuration or CPU, the
+	// automaton is used.
+	enum search_engine {
+		ENGINE_AUTOMATON,
+		ENGINE_TEDDY,        // SIMD fingerprints of the first bytes; up to 128 keywords.
+		ENGINE_SHIFT_OR,     // Bit-parallel; keywords up to 64 symbols in total.
+		ENGINE_FIXED_LENGTH, // Hash set of packed keywords that all have one length up to 16.
+		ENGINE_WU_MANBER,    // Shifts by the last two bytes of a window; long keywords.
+		ENGINE_FACTOR,       // Small automaton of one rare anchor per keyword; large dictionaries.
+		ENGINE_AUTO          // The first of Shift-Or, fixed length, Wu-Manber (for
+		                     // keywords of at least 16 bytes) and Teddy that applies.
+	};
+
+	// Representations of a state's transitions in a compiled automaton.
+	enum transition_representation {
+		REPRESENTATION_DENSE,   // Complete row of resolved transitions indexed by symbol.
+		REPRESENTATION_SORTED,  // Goto transitions sorted by symbol.
+		REPRESENTATION_SINGLE,  // A single goto transition stored in the state.
+		REPRESENTATION_BITMAP,  // Presence bitmap and goto transitions packed by rank.
+		REPRESENTATION_CHAIN,   // Label of a path whose interior states were collapsed.
+		REPRESENTATION_COUNT
+	};
+
+	// The representations chosen by basic_trie::compile and the resulting size.
+	class layout_statistics {
+		size_t d_state_count = 0;
+		size_t d_collapsed_count = 0;
+		size_t d_class_count = 0;
+		size_t d_shared_row_count = 0;
+		size_t d_bytes = 0;
+		size_t d_counts[REPRESENTATION_COUNT] = {};
+
+	public:
+		size_t state_count() const { return d_state_count; }
+		size_t collapsed_count() const { return d_collapsed_count; }
+		size_t class_count() const { return d_class_count; }
+		size_t shared_row_count() const { return d_shared_row_count; }
+		size_t bytes() const { return d_bytes; }
+		size_t count(transition_representation r) const { return d_counts[r]; }
+
+		void add_state(transition_representation r) { ++d_state_count; ++d_counts[r]; }
+		void add_collapsed(size_t count) { d_collapsed_count += count; }
+		void set_class_count(size_t count) { d_class_count = count; }
+		void add_shared_row() { ++d_shared_row_count; }
+		void add_bytes(size_t bytes) { d_bytes += bytes; }
+	};
+
 	// class state
-	template<typename CharType, template<typename, typename> class TransitionMap>
+	template<
+		typename CharType,
+		template<typename, typename> class TransitionMap = transition_map,
+		typename Allocator = std::allocator<CharType>
+	>
 	class state {
 	public:
-		typedef state*                              ptr;
-		typedef std::unique_ptr<state>              unique_ptr;
-		typedef std::basic_string<CharType>         string_type;
-		typedef std::basic_string<CharType>&        string_ref_type;
-		typedef std::pair<string_type, unsigned>    key_index;
-		typedef std::vector<key_index>              string_collection;
-		typedef TransitionMap<CharType, unique_ptr> transition_map;
+		typedef state*                                            ptr;
+		typedef allocator_deleter<state, Allocator>               deleter_type;
+		typedef std::unique_ptr<state, deleter_type>              unique_ptr;
+		typedef std::allocator_traits<Allocator>                  allocator_traits;
+		typedef typename allocator_traits::template rebind_alloc<CharType> allocator_type;
+		typedef std::basic_string<CharType, std::char_traits<CharType>, allocator_type> string_type;
+		typedef string_type&                                      string_ref_type;
+		typedef std::pair<string_type, unsigned>                  key_index;
+		typedef std::vector<
+			key_index,
+			typename allocator_traits::template rebind_alloc<key_index>
+		>                                                         string_collection;
+		typedef TransitionMap<CharType, unique_ptr>               transition_map;
+		typedef std::vector<
+			ptr,
+			typename allocator_traits::template rebind_alloc<ptr>
+		>                                                         state_ptr_collection;
 
 	private:
 		size_t                         d_depth;
@@ -364,19 +715,23 @@ namespace aho_corasick {
 		transition_map                 d_success;
 		ptr                            d_failure;
 		string_collection              d_emits;
+		state_ptr_collection           d_failure_dependents;
 
 	public:
 		state(): state(0) {}
 
-		state(size_t depth)
+		state(size_t depth, const allocator_type& alloc = allocator_type())
 			: d_depth(depth)
 			, d_idx(0)
 			, d_string_idx(0)
 			, d_root(depth == 0 ? this : nullptr)
 			, d_parent(nullptr)
-			, d_success()
+			, d_success(alloc)
 			, d_failure(nullptr)
-			, d_emits() {}
+			, d_emits(alloc)
+			, d_failure_dependents(alloc) {}
+
+		allocator_type get_allocator() const { return allocator_type(d_success.get_allocator()); }
 
 		ptr next_state(CharType character) const {
 			return next_state(character, false);
@@ -389,30 +744,100 @@ namespace aho_corasick {
 		ptr add_state(CharType character) {
 			auto next = next_state_ignore_root_state(character);
 			if (next == nullptr) {
-				next = new state(d_depth + 1);
+				deleter_type deleter(get_allocator());
+				unique_ptr next_ptr(deleter.create(d_depth + 1, get_allocator()), deleter);
+				next = next_ptr.get();
 				next->set_parent(this);
-				d_success.set_transition(character, next);
+				d_success.set_transition(character, std::move(next_ptr));
 			}
 			return next;
 		}
 
+		// Add a state for a character greater than that of any existing transition.
+		ptr append_state(CharType character) {
+			deleter_type deleter(get_allocator());
+			unique_ptr next_ptr(deleter.create(d_depth + 1, get_allocator()), deleter);
+			auto const next = next_ptr.get();
+			next->set_parent(this);
+			d_success.append_transition(character, std::move(next_ptr));
+			return next;
+		}
+
+		// Remove the transition on character together with the target state.
+		void remove_state(CharType character) {
+			d_success.erase_transition(character);
+		}
+
 		size_t get_depth() const { return d_depth; }
 
-		void add_emit(string_ref_type keyword, unsigned index) {
-			d_emits.emplace_back(keyword, index);
+		template <typename String>
+		void add_emit(const String& keyword, unsigned index) {
+			d_emits.emplace_back(string_type(keyword.begin(), keyword.end(), get_allocator()), index);
 		}
 
 		void add_emit(const string_collection& emits) {
 			for (const auto& e : emits) {
-				string_type str(e.first);
-				add_emit(str, e.second);
+				add_emit(e.first, e.second);
 			}
 		}
 
-		string_collection get_emits() const { return d_emits; }
+		// Emits inherited through the failure link are shorter than the state's
+		// own keywords; keep them first so that emits ending at the same position
+		// are reported shortest first.
+		void add_failure_emits(const string_collection& emits) {
+			d_emits.insert(d_emits.begin(), emits.begin(), emits.end());
+		}
+
+		string_collection const &get_emits() const { return d_emits; }
 
 		void clear_emits() { d_emits.clear(); }
 
+		// Insert an emit after the ones with a keyword of the same or smaller
+		// length, i.e. where a rebuild of the failure states would place it.
+		template <typename String>
+		void insert_emit(const String& keyword, unsigned index) {
+			auto it = std::upper_bound(d_emits.begin(), d_emits.end(), keyword.size(), [](size_t size, const key_index& e) -> bool {
+				return size < e.first.size();
+			});
+			d_emits.emplace(it, string_type(keyword.begin(), keyword.end(), get_allocator()), index);
+		}
+
+		template <typename Predicate>
+		void remove_emits_if(Predicate pred) {
+			d_emits.erase(std::remove_if(d_emits.begin(), d_emits.end(), pred), d_emits.end());
+		}
+
+		bool has_own_emits() const {
+			auto const depth = d_depth;
+			return std::any_of(d_emits.begin(), d_emits.end(), [depth](const key_index& e) -> bool {
+				return e.first.size() == depth;
+			});
+		}
+
+		// Remove the emits inherited through the failure link.
+		void clear_failure_emits() {
+			auto const depth = d_depth;
+			d_emits.erase(std::remove_if(d_emits.begin(), d_emits.end(), [depth](const key_index& e) -> bool {
+				return e.first.size() != depth;
+			}), d_emits.end());
+		}
+
+		// States whose failure link points to this state. Only maintained by
+		// basic_trie once the automaton is being updated after construction.
+		state_ptr_collection const &get_failure_dependents() const { return d_failure_dependents; }
+
+		void add_failure_dependent(ptr dependent) { d_failure_dependents.push_back(dependent); }
+
+		void remove_failure_dependent(ptr dependent) {
+			auto it = std::find(d_failure_dependents.begin(), d_failure_dependents.end(), dependent);
+			if (it != d_failure_dependents.end()) {
+				*it = d_failure_dependents.back();
+				d_failure_dependents.pop_back();
+			}
+		}
+
+		void clear_failure_dependents() { d_failure_dependents.clear(); }
+
 		ptr failure() const { return d_failure; }
 
 		void set_failure(ptr fail_state) { d_failure = fail_state; }
@@ -457,18 +882,31 @@ namespace aho_corasick {
 		}
 	};
 
-	template<typename CharType, template<typename, typename> class TransitionMap = transition_map>
+	template<
+		typename CharType,
+		template<typename, typename> class TransitionMap = transition_map,
+		typename Allocator = std::allocator<CharType>
+	>
 	class basic_trie {
 	public:
 		using string_type = std::basic_string < CharType > ;
 		using string_ref_type = std::basic_string<CharType>&;
 
-		typedef state<CharType, TransitionMap> state_type;
+		typedef state<CharType, TransitionMap, Allocator> state_type;
+		typedef typename state_type::allocator_type       allocator_type;
 		typedef state_type*                    state_ptr_type;
+		typedef std::vector<
+			state_ptr_type,
+			typename std::allocator_traits<allocator_type>::template rebind_alloc<state_ptr_type>
+		>                                      state_ptr_collection;
 		typedef token<CharType>                token_type;
 		typedef emit<CharType>                 emit_type;
 		typedef std::vector<token_type>        token_collection;
 		typedef std::vector<emit_type>         emit_collection;
+		typedef typename std::make_unsigned<CharType>::type symbol_type;
+
+		template <typename T>
+		using rebind_vector = std::vector<T, typename std::allocator_traits<allocator_type>::template rebind_alloc<T>>;
 
 		class config {
 			bool d_allow_overlaps;
@@ -476,6 +914,15 @@ namespace aho_corasick {
 			bool d_case_insensitive;
 			bool d_allow_substrings;
 			bool d_store_states_in_bfs_order;
+			size_t d_thread_count;
+			size_t d_transition_cache_size;
+			bool d_compile;
+			bool d_full_dfa;
+			bool d_minimize;
+			size_t d_memory_budget;
+			search_engine d_engine;
+			size_t d_long_keyword_threshold;
+			bool d_qgram_filter;
 
 		public:
 			config()
@@ -483,7 +930,16 @@ namespace aho_corasick {
 				, d_only_whole_words(false)
 				, d_case_insensitive(false)
 				, d_allow_substrings(true)
-				, d_store_states_in_bfs_order(false) {}
+				, d_store_states_in_bfs_order(false)
+				, d_thread_count(1)
+				, d_transition_cache_size(0)
+				, d_compile(false)
+				, d_full_dfa(false)
+				, d_minimize(false)
+				, d_memory_budget(0)
+				, d_engine(ENGINE_AUTOMATON)
+				, d_long_keyword_threshold(0)
+				, d_qgram_filter(false) {}
 
 			bool is_allow_overlaps() const { return d_allow_overlaps; }
 			void set_allow_overlaps(bool val) { d_allow_overlaps = val; }
@@ -499,151 +955,1966 @@ namespace aho_corasick {
 			
 			bool is_store_states_in_bfs_order() const { return d_store_states_in_bfs_order; }
 			void set_store_states_in_bfs_order(bool val) { d_store_states_in_bfs_order = val; }
-		};
 
-	private:
-		std::unique_ptr<state_type> d_root;
-		config                      d_config;
-		bool                        d_postprocessed;
-		unsigned                    d_num_keywords = 0;
-		size_t                      d_state_count = 0;
-		std::vector<state_ptr_type> d_states_in_bfs_order{};
-		std::vector<state_ptr_type> d_final_states_in_bfs_order{};
+			size_t get_thread_count() const { return d_thread_count; }
+			void set_thread_count(size_t val) { d_thread_count = (val ? val : 1); }
 
-	public:
-		basic_trie(): basic_trie(config()) {}
+			// Size in bytes of the per-scratch transition cache; 0 disables it.
+			size_t get_transition_cache_size() const { return d_transition_cache_size; }
+			void set_transition_cache_size(size_t val) { d_transition_cache_size = val; }
 
-		basic_trie(const config& c)
-			: d_root(new state_type())
-			, d_config(c)
-			, d_postprocessed(false) {}
+			bool is_compile() const { return d_compile; }
+			void set_compile(bool val) { d_compile = val; }
 
-		basic_trie& case_insensitive() {
-			d_config.set_case_insensitive(true);
-			return (*this);
-		}
+			bool is_full_dfa() const { return d_full_dfa; }
+			void set_full_dfa(bool val) { d_full_dfa = val; }
 
-		basic_trie& remove_overlaps() {
-			d_config.set_allow_overlaps(false);
-			return (*this);
-		}
+			bool is_minimize() const { return d_minimize; }
+			void set_minimize(bool val) { d_minimize = val; }
 
-		basic_trie& only_whole_words() {
-			d_config.set_only_whole_words(true);
-			return (*this);
-		}
+			// Upper bound in bytes for the compiled automaton; 0 for no limit.
+			size_t get_memory_budget() const { return d_memory_budget; }
+			void set_memory_budget(size_t val) { d_memory_budget = val; }
 
-		basic_trie& remove_substrings() {
-			d_config.set_allow_substrings(false);
-			return (*this);
-		}
-		
-		basic_trie& store_states_in_bfs_order() {
-			d_config.set_store_states_in_bfs_order(true);
-			return (*this);
-		}
+			search_engine get_engine() const { return d_engine; }
+			void set_engine(search_engine val) { d_engine = val; }
 
-		state_ptr_type insert(string_type keyword) {
-			if (keyword.empty())
-				return d_root.get();
-			state_ptr_type cur_state = d_root.get();
-			for (const auto& ch : keyword) {
-				cur_state = cur_state->add_state(ch);
-			}
-			
-			if (0 == cur_state->get_emits().size() || d_config.is_allow_substrings())
-			{
-				cur_state->add_emit(keyword, d_num_keywords++);
-				return cur_state;
-			}
+			// Keywords longer than this are indexed by a prefix of this length;
+			// 0 indexes every keyword completely.
+			size_t get_long_keyword_threshold() const { return d_long_keyword_threshold; }
+			void set_long_keyword_threshold(size_t val) { d_long_keyword_threshold = val; }
 
-			return nullptr;
-		}
+			bool is_qgram_filter() const { return d_qgram_filter; }
+			void set_qgram_filter(bool val) { d_qgram_filter = val; }
+		};
 
-		template<class InputIterator>
-		void insert(InputIterator first, InputIterator last) {
-			for (InputIterator it = first; first != last; ++it) {
-				insert(*it);
+		// Working memory for parse_text. Keep one per scanning thread and pass it
+		// with a reused emit_collection; once both have grown to the size needed
+		// by the input, parsing allocates nothing besides the emits: each emit
+		// owns a copy of its keyword, which is allocated unless it fits in the
+		// string's small buffer.
+		class scratch {
+			friend class basic_trie;
+
+			struct cached_transition {
+				state_ptr_type from      = nullptr;
+				state_ptr_type to        = nullptr;
+				CharType       character = CharType();
+			};
+
+			std::vector<interval>          d_kept;
+			std::vector<cached_transition> d_transitions;
+			std::vector<uint64_t>          d_prefix_hashes;
+			uint64_t                       d_generation = 0;
+			// Anchors found by the factor engine and the scratch of its trie.
+			emit_collection                d_anchors;
+			std::unique_ptr<scratch>       d_anchor_scratch;
+
+		public:
+			void clear() {
+				d_kept.clear();
+				d_transitions.clear();
+				d_prefix_hashes.clear();
+				d_generation = 0;
+				d_anchors.clear();
+				d_anchor_scratch.reset();
 			}
-		}
+		};
 
-		size_t num_keywords() const { return d_num_keywords; }
-		size_t num_states() const { return d_state_count; }
-		
-		state_ptr_type get_root() const { return d_root.get(); }
-		void reset_root() { d_root.reset(new state_type()); }
-		
-		std::vector<state_ptr_type> const &get_states_in_bfs_order() const { return d_states_in_bfs_order; }
-		std::vector<state_ptr_type> const &get_final_states_in_bfs_order() const { return d_final_states_in_bfs_order; }
+		// Finds the next symbol in a text that has a goto transition from the
+		// root. The automaton stays at the root, which has no emits, on all
+		// other symbols, so they can be skipped. Only used for one-byte
+		// character types.
+		class root_skip {
+			enum { MAX_VECTOR_SYMBOLS = 16 };
 
-		token_collection tokenise(string_type text) {
-			token_collection tokens;
-			auto collected_emits = parse_text(text);
-			size_t last_pos = interval::max_pos;
-			for (const auto& e : collected_emits) {
-				if (e.get_start() - last_pos > 1) {
-					tokens.push_back(create_fragment(e, text, last_pos));
+			bool    d_enabled = false;
+			bool    d_starts[256] = {};
+			uint8_t d_symbols[MAX_VECTOR_SYMBOLS] = {};
+			size_t  d_symbol_count = 0;
+
+		public:
+			void assign(const state_type& root, bool case_insensitive) {
+				d_symbol_count = 0;
+				d_enabled = (sizeof(CharType) == 1);
+				if (!d_enabled)
+					return;
+				for (size_t sym = 0; sym < 256; ++sym) {
+					// std::tolower is only defined for the values of unsigned char.
+					auto const c = static_cast<CharType>(case_insensitive ? std::tolower(static_cast<unsigned char>(sym)) : sym);
+					d_starts[sym] = (root.next_state_ignore_root_state(c) != nullptr);
+					if (d_starts[sym] && d_symbol_count < MAX_VECTOR_SYMBOLS)
+						d_symbols[d_symbol_count] = sym;
+					d_symbol_count += d_starts[sym];
 				}
-				tokens.push_back(create_match(e, text));
-				last_pos = e.get_end();
+				// Every symbol is a candidate; nothing to skip.
+				d_enabled = (d_symbol_count < 256);
 			}
-			if (text.size() - last_pos > 1) {
-				tokens.push_back(create_fragment(typename token_type::emit_type(), text, last_pos));
+
+			const CharType* find(const CharType* first, const CharType* last) const {
+				if (!d_enabled)
+					return first;
+				if (d_symbol_count == 1) {
+					auto const found = std::memchr(first, d_symbols[0], last - first);
+					return (found ? static_cast<const CharType*>(found) : last);
+				}
+#if defined(__SSE2__)
+				if (d_symbol_count <= MAX_VECTOR_SYMBOLS) {
+					for (; 16 <= last - first; first += 16) {
+						auto const block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+						auto hits = _mm_setzero_si128();
+						for (size_t i = 0; i < d_symbol_count; ++i)
+							hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(static_cast<char>(d_symbols[i]))));
+						auto const mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+						if (mask)
+							return first + count_trailing_zeros(mask);
+					}
+				}
+#endif
+				while (first != last && !d_starts[static_cast<uint8_t>(*first)])
+					++first;
+				return first;
 			}
-			return token_collection(tokens);
-		}
+		};
 
-		emit_collection parse_text(string_type text) {
-			check_postprocess();
-			size_t pos = 0;
-			state_ptr_type cur_state = d_root.get();
-			emit_collection collected_emits;
-			for (auto c : text) {
-				if (d_config.is_case_insensitive()) {
-					c = std::tolower(c);
+		// The keywords of the automaton with their indices, as searched for by
+		// the engines other than the automaton.
+		typedef std::vector<std::pair<string_type, unsigned>> keyword_collection;
+
+		// A keyword longer than the long keyword threshold. The automaton only
+		// emits its prefix; the tail is compared where the prefix is found,
+		// first by its polynomial hash and then character by character.
+		struct long_keyword {
+			typename state_type::string_type keyword;
+			uint64_t                         tail_hash;
+			uint64_t                         tail_power;
+		};
+		typedef std::unordered_map<
+			unsigned, long_keyword, std::hash<unsigned>, std::equal_to<unsigned>,
+			typename std::allocator_traits<allocator_type>::template rebind_alloc<std::pair<const unsigned, long_keyword>>
+		> long_keyword_map;
+
+		// A Bloom filter of the q-grams of the keywords, for q up to the length
+		// of the shortest keyword. A keyword can only occur in a part of the
+		// text in which every q-gram is in the filter, so the automaton only
+		// needs to scan such parts that are at least as long as the shortest
+		// keyword. The q-grams of the text are hashed with a rolling hash.
+		class qgram_filter {
+			enum { MAX_LENGTH = 4, MIN_BITS_LOG2 = 10, MAX_BITS_LOG2 = 22, BITS_PER_GRAM = 16 };
+
+			std::vector<uint64_t> d_bits;
+			unsigned              d_shift = 0;
+			size_t                d_length = 0;
+			size_t                d_min_length = 0;
+			uint64_t              d_drop = 0;
+			bool                  d_case_insensitive = false;
+
+		public:
+			bool empty() const { return d_bits.empty(); }
+			size_t length() const { return d_length; }
+
+			// Fails if a keyword is too short for the filter to reject anything.
+			bool assign(const keyword_collection& keywords, bool case_insensitive) {
+				d_bits.clear();
+				if (keywords.empty())
+					return false;
+				d_min_length = std::min_element(keywords.begin(), keywords.end(), [](const typename keyword_collection::value_type& a, const typename keyword_collection::value_type& b) -> bool {
+					return a.first.size() < b.first.size();
+				})->first.size();
+				if (d_min_length < 2)
+					return false;
+				d_length = std::min<size_t>(d_min_length, MAX_LENGTH);
+				d_case_insensitive = case_insensitive;
+				d_drop = 1;
+				for (size_t i = 0; i < d_length; ++i)
+					d_drop *= hash_base;
+
+				size_t grams = 0;
+				for (const auto& k : keywords)
+					grams += k.first.size() - d_length + 1;
+				unsigned bits_log2 = MIN_BITS_LOG2;
+				while (bits_log2 < MAX_BITS_LOG2 && (size_t(1) << bits_log2) < grams * BITS_PER_GRAM)
+					++bits_log2;
+				d_shift = 64 - bits_log2;
+				d_bits.assign((size_t(1) << bits_log2) / 64, 0);
+
+				for (const auto& k : keywords) {
+					uint64_t key = 0;
+					for (size_t i = 0; i < k.first.size(); ++i) {
+						key = key * hash_base + hash_symbol(k.first[i]);
+						if (i >= d_length)
+							key -= d_drop * hash_symbol(k.first[i - d_length]);
+						if (i + 1 >= d_length)
+							add(key);
+					}
 				}
-				cur_state = get_state(cur_state, c);
-				store_emits(pos, cur_state, collected_emits);
-				pos++;
+				return true;
 			}
-			if (d_config.is_only_whole_words()) {
-				remove_partial_matches(text, collected_emits);
+
+			// Call f(begin, end) for the parts of text that may contain a keyword,
+			// in order.
+			template <typename F>
+			void for_each_candidate(const string_type& text, F f) const {
+				auto const size = text.size();
+				if (size < d_min_length)
+					return;
+				auto const symbol = [this, &text](size_t i) -> uint64_t {
+					auto c = text[i];
+					if (d_case_insensitive) {
+						c = fold_case(c);
+					}
+					return hash_symbol(c);
+				};
+				uint64_t key = 0;
+				for (size_t i = 0; i + 1 < d_length; ++i)
+					key = key * hash_base + symbol(i);
+				size_t begin = 0;
+				bool in_part = false;
+				for (size_t i = d_length - 1; i < size; ++i) {
+					key = key * hash_base + symbol(i);
+					if (i >= d_length)
+						key -= d_drop * symbol(i - d_length);
+					// The q-gram ending at i.
+					if (contains(key)) {
+						if (!in_part) {
+							begin = i + 1 - d_length;
+							in_part = true;
+						}
+					} else if (in_part) {
+						in_part = false;
+						if (i - begin >= d_min_length)
+							f(begin, i);
+					}
+				}
+				if (in_part && size - begin >= d_min_length)
+					f(begin, size);
 			}
-			if (!d_config.is_allow_overlaps()) {
-				interval_tree<emit_type> tree(typename interval_tree<emit_type>::interval_collection(collected_emits.begin(), collected_emits.end()));
-				auto tmp = tree.remove_overlaps(collected_emits);
-				collected_emits.swap(tmp);
+
+		private:
+			void add(uint64_t key) {
+				auto const a = (key * 0x9e3779b97f4a7c15ULL) >> d_shift;
+				auto const b = (key * 0xc2b2ae3d27d4eb4fULL) >> d_shift;
+				d_bits[a / 64] |= uint64_t(1) << (a % 64);
+				d_bits[b / 64] |= uint64_t(1) << (b % 64);
 			}
-			return emit_collection(collected_emits);
-		}
 
-		void check_postprocess() {
-			if (!d_postprocessed) {
-				assign_indices();
+			bool contains(uint64_t key) const {
+				auto const a = (key * 0x9e3779b97f4a7c15ULL) >> d_shift;
+				auto const b = (key * 0xc2b2ae3d27d4eb4fULL) >> d_shift;
+				return ((d_bits[a / 64] >> (a % 64)) & (d_bits[b / 64] >> (b % 64)) & 1) != 0;
+			}
+		};
 
-				if (!d_config.is_allow_substrings())
-					remove_prefixes();
-				
-				construct_failure_states();
-				
-				// construct_failure_states clears emits; store final states
-				// only after doing that.
-				if (d_config.is_store_states_in_bfs_order())
-				{
-					for (auto const cur_state : d_states_in_bfs_order)
-					{
-						if (cur_state->get_emits().size())
-							d_final_states_in_bfs_order.push_back(cur_state);
+		// Teddy: keywords are put in eight buckets, and for each of the first
+		// (up to three) bytes of a keyword, two 16-entry tables map the low
+		// and the high nibble of a text byte to the buckets that accept it.
+		// PSHUFB looks up 16 text positions at once; positions where some
+		// bucket accepts every byte are verified against the keywords in the
+		// bucket.
+		class teddy_matcher {
+			enum { MAX_KEYWORDS = 128, BUCKETS = 8, MAX_FINGERPRINT = 3 };
+
+			keyword_collection d_keywords;          // Ordered by bucket.
+			uint32_t           d_bucket_offsets[BUCKETS + 1] = {};
+			uint8_t            d_low[MAX_FINGERPRINT][16];
+			uint8_t            d_high[MAX_FINGERPRINT][16];
+			size_t             d_fingerprint = 0;
+			bool               d_case_insensitive = false;
+
+		public:
+			// Returns false if the keywords cannot be searched with Teddy here.
+			bool assign(keyword_collection keywords, bool case_insensitive) {
+				if (sizeof(CharType) != 1 || keywords.empty() || MAX_KEYWORDS < keywords.size() || !is_supported())
+					return false;
+
+				d_case_insensitive = case_insensitive;
+				d_fingerprint = MAX_FINGERPRINT;
+				for (const auto& k : keywords)
+					d_fingerprint = std::min(d_fingerprint, k.first.size());
+
+				// Keywords with the same first bytes share a bucket, which keeps
+				// the sets of bytes accepted by each bucket small.
+				std::sort(keywords.begin(), keywords.end());
+				d_keywords = std::move(keywords);
+				auto const count = d_keywords.size();
+				for (size_t b = 0; b <= BUCKETS; ++b)
+					d_bucket_offsets[b] = b * count / BUCKETS;
+
+				std::memset(d_low, 0, sizeof(d_low));
+				std::memset(d_high, 0, sizeof(d_high));
+				for (size_t b = 0; b < BUCKETS; ++b) {
+					for (auto i = d_bucket_offsets[b]; i < d_bucket_offsets[b + 1]; ++i) {
+						for (size_t j = 0; j < d_fingerprint; ++j) {
+							auto const expected = static_cast<uint8_t>(d_keywords[i].first[j]);
+							for (size_t byte = 0; byte < 256; ++byte) {
+								if (fold(byte) == expected) {
+									d_low[j][byte & 0xf] |= uint8_t(1) << b;
+									d_high[j][byte >> 4] |= uint8_t(1) << b;
+								}
+							}
+						}
 					}
 				}
+				return true;
+			}
 
-				d_postprocessed = true;
+			void find(const string_type& text, emit_collection& collected_emits) const {
+				auto const data = reinterpret_cast<const uint8_t*>(text.data());
+				size_t pos = 0;
+#if defined(AHO_CORASICK_HAS_SSSE3_TARGET)
+				pos = find_ssse3(data, text.size(), collected_emits);
+#endif
+				for (; pos < text.size(); ++pos) {
+					unsigned buckets = 0xff;
+					for (size_t j = 0; j < d_fingerprint && buckets; ++j) {
+						if (text.size() <= pos + j)
+							buckets = 0;
+						else
+							buckets &= d_low[j][data[pos + j] & 0xf] & d_high[j][data[pos + j] >> 4];
+					}
+					if (buckets)
+						verify(data, text.size(), pos, buckets, collected_emits);
+				}
 			}
-		}
 
-	private:
-		token_type create_fragment(const typename token_type::emit_type& e, string_ref_type text, size_t last_pos) const {
-			auto start = last_pos + 1;
+		private:
+			static bool is_supported() {
+#if defined(AHO_CORASICK_HAS_SSSE3_TARGET)
+				return __builtin_cpu_supports("ssse3");
+#else
+				return false;
+#endif
+			}
+
+			uint8_t fold(size_t byte) const {
+				auto c = static_cast<CharType>(byte);
+				if (d_case_insensitive) {
+					c = fold_case(c);
+				}
+				return static_cast<uint8_t>(c);
+			}
+
+			void verify(const uint8_t* data, size_t size, size_t start, unsigned buckets, emit_collection& collected_emits) const {
+				for (; buckets; buckets &= buckets - 1) {
+					auto const b = count_trailing_zeros(buckets);
+					for (auto i = d_bucket_offsets[b]; i < d_bucket_offsets[b + 1]; ++i) {
+						auto const& keyword = d_keywords[i].first;
+						if (size - start < keyword.size())
+							continue;
+						size_t j = 0;
+						while (j < keyword.size() && fold(data[start + j]) == static_cast<uint8_t>(keyword[j]))
+							++j;
+						if (j == keyword.size())
+							collected_emits.emplace_back(start, start + keyword.size() - 1, keyword, d_keywords[i].second);
+					}
+				}
+			}
+
+#if defined(AHO_CORASICK_HAS_SSSE3_TARGET)
+			// Returns the position from which the rest of the text is to be
+			// searched without vectors.
+			__attribute__((target("ssse3")))
+			size_t find_ssse3(const uint8_t* data, size_t size, emit_collection& collected_emits) const {
+				__m128i low[MAX_FINGERPRINT], high[MAX_FINGERPRINT];
+				for (size_t j = 0; j < d_fingerprint; ++j) {
+					low[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d_low[j]));
+					high[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d_high[j]));
+				}
+				auto const nibble = _mm_set1_epi8(0xf);
+				auto const zero = _mm_setzero_si128();
+				alignas(16) uint8_t lanes[16];
+				size_t pos = 0;
+				for (; pos + 16 + d_fingerprint - 1 <= size; pos += 16) {
+					auto accepted = _mm_set1_epi8(-1);
+					for (size_t j = 0; j < d_fingerprint; ++j) {
+						auto const block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + j));
+						auto const lo = _mm_shuffle_epi8(low[j], _mm_and_si128(block, nibble));
+						auto const hi = _mm_shuffle_epi8(high[j], _mm_and_si128(_mm_srli_epi16(block, 4), nibble));
+						accepted = _mm_and_si128(accepted, _mm_and_si128(lo, hi));
+					}
+					auto mask = ~static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(accepted, zero))) & 0xffff;
+					if (!mask)
+						continue;
+					_mm_store_si128(reinterpret_cast<__m128i*>(lanes), accepted);
+					for (; mask; mask &= mask - 1) {
+						auto const lane = count_trailing_zeros(mask);
+						verify(data, size, pos + lane, lanes[lane], collected_emits);
+					}
+				}
+				return pos;
+			}
+#endif
+		};
+
+		// Shift-And over the concatenated keywords: bit i of the state is set
+		// when the text read so far ends with the first i + 1 symbols of the
+		// keyword that bit i belongs to. Each step shifts the state, sets the
+		// bits of the first symbols and keeps the bits whose symbol matches.
+		class shift_or_matcher {
+			enum { WORD_BITS = 64 };
+
+			uint64_t           d_masks[256];
+			uint64_t           d_starts = 0;
+			uint64_t           d_ends = 0;
+			uint8_t            d_owners[WORD_BITS];    // Keyword ending at each bit.
+			keyword_collection d_keywords;
+
+		public:
+			// Returns false if the keywords do not fit in a word.
+			bool assign(const keyword_collection& keywords, bool case_insensitive) {
+				size_t total = 0;
+				for (const auto& k : keywords)
+					total += k.first.size();
+				if (sizeof(CharType) != 1 || keywords.empty() || WORD_BITS < total)
+					return false;
+
+				// Emits that end at the same position are then found by length
+				// and index, the order that the automaton reports them in.
+				d_keywords = keywords;
+				std::sort(d_keywords.begin(), d_keywords.end(), [](const std::pair<string_type, unsigned>& a, const std::pair<string_type, unsigned>& b) -> bool {
+					if (a.first.size() != b.first.size())
+						return a.first.size() < b.first.size();
+					return a.second < b.second;
+				});
+
+				std::memset(d_masks, 0, sizeof(d_masks));
+				d_starts = 0;
+				d_ends = 0;
+				size_t bit = 0;
+				for (size_t i = 0; i < d_keywords.size(); ++i) {
+					auto const& keyword = d_keywords[i].first;
+					d_starts |= uint64_t(1) << bit;
+					for (auto c : keyword) {
+						for (size_t byte = 0; byte < 256; ++byte) {
+							auto t = static_cast<CharType>(byte);
+							if (case_insensitive) {
+								t = fold_case(t);
+							}
+							if (t == c)
+								d_masks[byte] |= uint64_t(1) << bit;
+						}
+						++bit;
+					}
+					d_ends |= uint64_t(1) << (bit - 1);
+					d_owners[bit - 1] = i;
+				}
+				return true;
+			}
+
+			void find(const string_type& text, emit_collection& collected_emits) const {
+				uint64_t matched = 0;
+				for (size_t pos = 0; pos < text.size(); ++pos) {
+					matched = ((matched << 1) | d_starts) & d_masks[static_cast<uint8_t>(text[pos])];
+					for (auto ends = matched & d_ends; ends; ends &= ends - 1) {
+						auto const& k = d_keywords[d_owners[count_trailing_zeros(ends)]];
+						collected_emits.emplace_back(pos + 1 - k.first.size(), pos, k.first, k.second);
+					}
+				}
+			}
+		};
+
+		// Keywords that all have the same length of up to 16 bytes are packed
+		// into two 64-bit words and stored in an open addressing hash table.
+		// The last bytes of the text are kept packed the same way while
+		// reading it, so each position takes one shift and one probe.
+		class fixed_length_matcher {
+			enum { MAX_LENGTH = 16 };
+
+			struct packed_key {
+				uint64_t low;
+				uint64_t high;
+
+				bool operator==(const packed_key& other) const { return low == other.low && high == other.high; }
+			};
+
+			struct slot {
+				packed_key key;
+				uint32_t   first;              // Keywords with this key in d_keywords.
+				uint32_t   count;              // Zero for an empty slot.
+			};
+
+			std::vector<slot>  d_slots;
+			keyword_collection d_keywords;     // Ordered by key and index.
+			size_t             d_length = 0;
+			size_t             d_shift = 0;
+			uint64_t           d_high_mask = 0;
+			uint8_t            d_fold[256];
+
+		public:
+			// Returns false unless all keywords have the same length.
+			bool assign(keyword_collection keywords, bool case_insensitive) {
+				if (sizeof(CharType) != 1 || keywords.empty())
+					return false;
+				d_length = keywords.front().first.size();
+				if (MAX_LENGTH < d_length)
+					return false;
+				for (const auto& k : keywords) {
+					if (k.first.size() != d_length)
+						return false;
+				}
+
+				for (size_t byte = 0; byte < 256; ++byte) {
+					auto c = static_cast<CharType>(byte);
+					if (case_insensitive) {
+						c = fold_case(c);
+					}
+					d_fold[byte] = static_cast<uint8_t>(c);
+				}
+				d_high_mask = (d_length <= 8 ? 0 : ~uint64_t(0) >> (8 * (MAX_LENGTH - d_length)));
+
+				std::sort(keywords.begin(), keywords.end(), [](const std::pair<string_type, unsigned>& a, const std::pair<string_type, unsigned>& b) -> bool {
+					return (a.first == b.first ? a.second < b.second : a.first < b.first);
+				});
+				d_keywords = std::move(keywords);
+
+				size_t capacity = 2;
+				d_shift = 63;
+				while (capacity < 2 * d_keywords.size()) {
+					capacity *= 2;
+					--d_shift;
+				}
+				d_slots.assign(capacity, slot());
+				for (size_t i = 0; i < d_keywords.size(); ++i) {
+					packed_key key = {};
+					for (auto c : d_keywords[i].first)
+						key = push(key, static_cast<uint8_t>(c));
+					auto idx = position(key);
+					while (d_slots[idx].count && !(d_slots[idx].key == key))
+						idx = (idx + 1) & (capacity - 1);
+					if (!d_slots[idx].count) {
+						d_slots[idx].key = key;
+						d_slots[idx].first = i;
+					}
+					++d_slots[idx].count;
+				}
+				return true;
+			}
+
+			void find(const string_type& text, emit_collection& collected_emits) const {
+				auto const data = reinterpret_cast<const uint8_t*>(text.data());
+				auto const mask = d_slots.size() - 1;
+				packed_key key = {};
+				for (size_t pos = 0; pos < text.size(); ++pos) {
+					key = push(key, d_fold[data[pos]]);
+					if (pos + 1 < d_length)
+						continue;
+					for (auto idx = position(key); d_slots[idx].count; idx = (idx + 1) & mask) {
+						auto const& s = d_slots[idx];
+						if (!(s.key == key))
+							continue;
+						for (auto i = s.first; i < s.first + s.count; ++i)
+							collected_emits.emplace_back(pos + 1 - d_length, pos, d_keywords[i].first, d_keywords[i].second);
+						break;
+					}
+				}
+			}
+
+		private:
+			packed_key push(const packed_key& key, uint8_t byte) const {
+				if (d_length <= 8) {
+					auto const low = (d_length == 8 ? key.low << 8 : (key.low << 8) & ((uint64_t(1) << (8 * d_length)) - 1));
+					return packed_key{low | byte, 0};
+				}
+				return packed_key{key.low << 8 | byte, (key.high << 8 | key.low >> 56) & d_high_mask};
+			}
+
+			size_t position(const packed_key& key) const {
+				auto const h = (key.low ^ (key.high * UINT64_C(0xC2B2AE3D27D4EB4F))) * UINT64_C(0x9E3779B97F4A7C15);
+				return static_cast<size_t>(h >> d_shift);
+			}
+		};
+
+		// Wu-Manber: a window as long as the shortest keyword is moved along
+		// the text. The last two bytes of the window give how far it can be
+		// moved without skipping the end of a keyword prefix that fits in the
+		// window. Where the shift is zero, keywords starting at the window
+		// are found by walking the trie from the root.
+		class wu_manber_matcher {
+			enum { BLOCK = 2 };
+
+			std::vector<uint32_t> d_shifts;    // Indexed by the two folded bytes.
+			state_ptr_type        d_root = nullptr;
+			size_t                d_window = 0;
+			uint8_t               d_fold[256];
+
+		public:
+			// Returns false if a keyword is shorter than a block.
+			bool assign(const keyword_collection& keywords, bool case_insensitive, state_ptr_type root) {
+				if (sizeof(CharType) != 1 || keywords.empty())
+					return false;
+				d_window = std::numeric_limits<size_t>::max();
+				for (const auto& k : keywords)
+					d_window = std::min(d_window, k.first.size());
+				if (d_window < BLOCK)
+					return false;
+
+				for (size_t byte = 0; byte < 256; ++byte) {
+					auto c = static_cast<CharType>(byte);
+					if (case_insensitive) {
+						c = fold_case(c);
+					}
+					d_fold[byte] = static_cast<uint8_t>(c);
+				}
+				d_root = root;
+				d_shifts.assign(1 << 16, d_window - BLOCK + 1);
+				for (const auto& k : keywords) {
+					for (size_t end = BLOCK; end <= d_window; ++end) {
+						auto const idx = block(static_cast<uint8_t>(k.first[end - 2]), static_cast<uint8_t>(k.first[end - 1]));
+						d_shifts[idx] = std::min<uint32_t>(d_shifts[idx], d_window - end);
+					}
+				}
+				return true;
+			}
+
+			void find(const string_type& text, emit_collection& collected_emits) const {
+				auto const data = reinterpret_cast<const uint8_t*>(text.data());
+				size_t pos = 0;
+				while (pos + d_window <= text.size()) {
+					auto const last = data + pos + d_window;
+					auto const shift = d_shifts[block(d_fold[last[-2]], d_fold[last[-1]])];
+					if (shift) {
+						pos += shift;
+						continue;
+					}
+					verify(data, text.size(), pos, collected_emits);
+					++pos;
+				}
+			}
+
+			size_t window() const { return d_window; }
+
+		private:
+			static size_t block(uint8_t first, uint8_t second) { return (size_t(first) << 8) | second; }
+
+			void verify(const uint8_t* data, size_t size, size_t start, emit_collection& collected_emits) const {
+				auto cur_state = d_root;
+				for (auto pos = start; pos < size; ++pos) {
+					cur_state = cur_state->next_state_ignore_root_state(static_cast<CharType>(d_fold[data[pos]]));
+					if (cur_state == nullptr)
+						return;
+					for (const auto& e : cur_state->get_emits()) {
+						if (e.first.size() == cur_state->get_depth())
+							collected_emits.emplace_back(start, pos, typename emit_type::string_type(e.first.data(), e.first.size()), e.second);
+					}
+				}
+			}
+		};
+
+		// Factor prefilter: each keyword is represented by one of its substrings
+		// of up to four symbols, the one that the fewest keywords contain. The
+		// anchors are searched with a small compiled automaton that fits in
+		// cache even when the full automaton does not, and each keyword of an
+		// anchor that is found is compared with the text around it.
+		class factor_matcher {
+			enum { ANCHOR_LENGTH = 4 };
+
+			struct candidate {
+				uint32_t keyword;              // Position in d_keywords.
+				uint32_t offset;               // Start of the anchor in the keyword.
+			};
+
+			std::unique_ptr<basic_trie> d_anchors;
+			std::vector<uint32_t>       d_first;      // Candidates of each anchor.
+			std::vector<candidate>      d_candidates;
+			keyword_collection          d_keywords;
+			bool                        d_case_insensitive = false;
+
+		public:
+			bool assign(keyword_collection keywords, bool case_insensitive, const allocator_type& alloc) {
+				d_anchors.reset();
+				if (keywords.empty() || std::numeric_limits<uint32_t>::max() <= keywords.size())
+					return false;
+				d_keywords = std::move(keywords);
+				d_case_insensitive = case_insensitive;
+
+				std::unordered_map<string_type, uint32_t> counts;
+				for (const auto& k : d_keywords) {
+					auto const length = std::min<size_t>(k.first.size(), ANCHOR_LENGTH);
+					for (size_t i = 0; i + length <= k.first.size(); ++i)
+						++counts[k.first.substr(i, length)];
+				}
+
+				// Number the anchors, and count the keywords of each.
+				std::unordered_map<string_type, uint32_t> anchor_ids;
+				std::vector<string_type> anchors;
+				std::vector<candidate> chosen(d_keywords.size());
+				d_first.clear();
+				for (uint32_t k = 0; k < d_keywords.size(); ++k) {
+					const auto& keyword = d_keywords[k].first;
+					auto const length = std::min<size_t>(keyword.size(), ANCHOR_LENGTH);
+					size_t best = 0;
+					uint32_t best_count = std::numeric_limits<uint32_t>::max();
+					for (size_t i = 0; i + length <= keyword.size(); ++i) {
+						auto const count = counts[keyword.substr(i, length)];
+						if (count < best_count) {
+							best = i;
+							best_count = count;
+						}
+					}
+					auto const inserted = anchor_ids.emplace(keyword.substr(best, length), static_cast<uint32_t>(anchors.size()));
+					if (inserted.second) {
+						anchors.push_back(inserted.first->first);
+						d_first.push_back(0);
+					}
+					chosen[k] = candidate{inserted.first->second, static_cast<uint32_t>(best)};
+					++d_first[inserted.first->second];
+				}
+
+				uint32_t total = 0;
+				for (auto& first : d_first) {
+					auto const count = first;
+					first = total;
+					total += count;
+				}
+				d_first.push_back(total);
+				d_candidates.assign(total, candidate());
+				std::vector<uint32_t> next(d_first.begin(), d_first.end() - 1);
+				for (uint32_t k = 0; k < chosen.size(); ++k)
+					d_candidates[next[chosen[k].keyword]++] = candidate{k, chosen[k].offset};
+
+				d_anchors.reset(new basic_trie(config(), alloc));
+				if (case_insensitive)
+					d_anchors->case_insensitive();
+				d_anchors->insert(anchors.begin(), anchors.end());
+				d_anchors->compile();
+				return true;
+			}
+
+			// Uses the anchor collection and the anchor trie's scratch kept in s.
+			void find(const string_type& text, emit_collection& collected_emits, scratch& s) const {
+				auto& anchors = s.d_anchors;
+				if (!s.d_anchor_scratch)
+					s.d_anchor_scratch.reset(new scratch());
+				static_cast<const basic_trie&>(*d_anchors).parse_text(text, anchors, *s.d_anchor_scratch);
+				for (const auto& a : anchors) {
+					auto const end = d_first[a.get_index() + 1];
+					for (auto i = d_first[a.get_index()]; i < end; ++i) {
+						auto const& c = d_candidates[i];
+						auto const& k = d_keywords[c.keyword];
+						if (a.get_start() < c.offset || text.size() - (a.get_start() - c.offset) < k.first.size())
+							continue;
+						auto const start = a.get_start() - c.offset;
+						if (equal(k.first, text, start))
+							collected_emits.emplace_back(start, start + k.first.size() - 1, k.first, k.second);
+					}
+				}
+			}
+
+			size_t anchor_count() const { return (d_anchors ? d_anchors->num_keywords() : 0); }
+
+		private:
+			bool equal(const string_type& keyword, const string_type& text, size_t start) const {
+				if (!d_case_insensitive)
+					return 0 == std::char_traits<CharType>::compare(text.data() + start, keyword.data(), keyword.size());
+				return std::equal(keyword.begin(), keyword.end(), text.begin() + start, [](CharType k, CharType c) -> bool {
+					return k == fold_case(c);
+				});
+			}
+		};
+
+		// Flat copy of the automaton with the states numbered in BFS order. Each
+		// state's transitions are stored in the representation chosen for it by
+		// basic_trie::compile. Dense rows hold the resolved transition for every
+		// symbol class, so states that have one never follow their failure
+		// link. Symbols that label no transition share a class.
+		// Bitmap nodes mark the symbols that have a goto transition; the target
+		// is found by counting the marked symbols below the one looked up.
+		// A chain replaces a path of states that have one transition and no
+		// emits with its label, the failure state of each collapsed state and
+		// the state at the end of the path.
+		class compiled_automaton {
+			friend class basic_trie;
+
+		public:
+			enum : uint32_t { NO_STATE = std::numeric_limits<uint32_t>::max() };
+
+		private:
+			struct compiled_state {
+				uint32_t failure;
+				uint32_t offset;         // Row, first transition or label, bitmap or target.
+				uint32_t count;          // Transition count, label length or symbol.
+				uint8_t  representation;
+			};
+
+			struct bitmap_node {
+				uint64_t bits[4];
+				uint32_t children;       // First target in d_children.
+				uint8_t  ranks[4];       // Marked symbols in the preceding words.
+			};
+
+			typedef typename state_type::string_type keyword_type;
+
+			rebind_vector<compiled_state> d_states;
+			rebind_vector<uint32_t>       d_emit_offsets;
+			rebind_vector<uint32_t>       d_emits;
+			rebind_vector<symbol_type>    d_symbols;
+			rebind_vector<uint32_t>       d_targets;
+			rebind_vector<uint32_t>       d_rows;
+			uint8_t                       d_classes[256];
+			rebind_vector<bitmap_node>    d_bitmaps;
+			rebind_vector<uint32_t>       d_children;
+			rebind_vector<symbol_type>    d_chain_symbols;
+			rebind_vector<uint32_t>       d_chain_states;
+			rebind_vector<keyword_type>   d_keywords;
+			rebind_vector<unsigned>       d_keyword_indices;
+			layout_statistics             d_statistics;
+
+		public:
+			explicit compiled_automaton(const allocator_type& alloc)
+				: d_states(alloc)
+				, d_emit_offsets(alloc)
+				, d_emits(alloc)
+				, d_symbols(alloc)
+				, d_targets(alloc)
+				, d_rows(alloc)
+				, d_bitmaps(alloc)
+				, d_children(alloc)
+				, d_chain_symbols(alloc)
+				, d_chain_states(alloc)
+				, d_keywords(alloc)
+				, d_keyword_indices(alloc) {}
+
+			bool empty() const { return d_states.empty(); }
+			size_t size() const { return d_states.size(); }
+
+			transition_representation representation(size_t idx) const {
+				return static_cast<transition_representation>(d_states[idx].representation);
+			}
+
+			layout_statistics const &get_layout_statistics() const { return d_statistics; }
+
+			void clear() {
+				d_states.clear();
+				d_emit_offsets.clear();
+				d_emits.clear();
+				d_symbols.clear();
+				d_targets.clear();
+				d_rows.clear();
+				d_bitmaps.clear();
+				d_children.clear();
+				d_chain_symbols.clear();
+				d_chain_states.clear();
+				d_keywords.clear();
+				d_keyword_indices.clear();
+				d_statistics = layout_statistics();
+			}
+
+			// The goto transition, or NO_STATE if there is none. Always succeeds
+			// for states with a dense row. Chains are followed with advance.
+			uint32_t goto_state(uint32_t cur, symbol_type symbol) const {
+				auto const& st = d_states[cur];
+				assert(st.representation != REPRESENTATION_CHAIN);
+				switch (st.representation) {
+				case REPRESENTATION_DENSE:
+					return d_rows[st.offset + d_classes[symbol]];
+				case REPRESENTATION_SINGLE:
+					return (st.count == symbol ? st.offset : uint32_t(NO_STATE));
+				case REPRESENTATION_BITMAP:
+					return find_bitmap(d_bitmaps[st.offset], symbol);
+				default:
+					return find_sorted(st, symbol);
+				}
+			}
+
+			// Resolves a transition for states whose failure path has no chains.
+			uint32_t next_state(uint32_t cur, symbol_type symbol) const {
+				while (true) {
+					auto const next = goto_state(cur, symbol);
+					if (next != NO_STATE)
+						return next;
+					if (cur == 0)
+						return 0;
+					cur = d_states[cur].failure;
+				}
+			}
+
+			// The state after the symbol at pos. If a chain is followed, pos is
+			// moved to the last symbol consumed; the collapsed states have no
+			// emits, so none are missed on the way.
+			template <typename SymbolAt>
+			uint32_t advance(uint32_t cur, SymbolAt symbol_at, size_t size, size_t& pos) const {
+				auto symbol = symbol_at(pos);
+				while (true) {
+					auto const& st = d_states[cur];
+					if (st.representation == REPRESENTATION_CHAIN) {
+						auto const label = d_chain_symbols.data() + st.offset;
+						auto const states = d_chain_states.data() + st.offset;
+						if (label[0] == symbol) {
+							size_t const length = std::min<size_t>(st.count, size - pos);
+							size_t matched = 1;
+							while (matched < length && label[matched] == symbol_at(pos + matched))
+								++matched;
+							if (matched == st.count) {
+								pos += matched - 1;
+								return states[matched - 1];
+							}
+							// Continue from the failure state of the collapsed state
+							// reached. It has no emits either.
+							cur = states[matched - 1];
+							pos += matched;
+							if (pos == size) {
+								--pos;
+								return cur;
+							}
+							symbol = symbol_at(pos);
+							continue;
+						}
+					} else {
+						auto const next = goto_state(cur, symbol);
+						if (next != NO_STATE)
+							return next;
+					}
+					if (cur == 0)
+						return 0;
+					cur = st.failure;
+				}
+			}
+
+			void store_emits(size_t pos, uint32_t cur, emit_collection& collected_emits) const {
+				auto const end = d_emit_offsets[cur + 1];
+				for (auto i = d_emit_offsets[cur]; i < end; ++i) {
+					auto const& keyword = d_keywords[d_emits[i]];
+					collected_emits.emplace_back(
+						pos - keyword.size() + 1,
+						pos,
+						typename emit_type::string_type(keyword.data(), keyword.size()),
+						d_keyword_indices[d_emits[i]]
+					);
+				}
+			}
+
+		private:
+			uint32_t find_bitmap(const bitmap_node& node, symbol_type symbol) const {
+				auto const word = symbol / 64;
+				auto const bit = uint64_t(1) << (symbol % 64);
+				if (!(node.bits[word] & bit))
+					return NO_STATE;
+				return d_children[node.children + node.ranks[word] + popcount(node.bits[word] & (bit - 1))];
+			}
+
+			uint32_t find_sorted(const compiled_state& st, symbol_type symbol) const {
+				auto const first = d_symbols.data() + st.offset;
+				auto const last = first + st.count;
+				if (st.count <= 8) {
+					for (auto it = first; it != last; ++it) {
+						if (*it == symbol)
+							return d_targets[st.offset + (it - first)];
+					}
+					return NO_STATE;
+				}
+				auto const it = std::lower_bound(first, last, symbol);
+				if (it != last && *it == symbol)
+					return d_targets[st.offset + (it - first)];
+				return NO_STATE;
+			}
+		};
+
+	private:
+		typename state_type::unique_ptr d_root;
+		config                      d_config;
+		bool                        d_postprocessed;
+		uint64_t                    d_generation = next_generation();
+		compiled_automaton          d_compiled;
+		root_skip                   d_root_skip;
+		teddy_matcher               d_teddy;
+		shift_or_matcher            d_shift_or;
+		fixed_length_matcher        d_fixed_length;
+		wu_manber_matcher           d_wu_manber;
+		factor_matcher              d_factor;
+		uint64_t                    d_engine_generation = 0;
+		search_engine               d_active_engine = ENGINE_AUTOMATON;
+		long_keyword_map            d_long_keywords;
+		qgram_filter                d_filter;
+		uint64_t                    d_filter_generation = 0;
+		bool                        d_has_failure_dependents = false;
+		bool                        d_has_keyword_states = false;
+		state_ptr_collection        d_keyword_states;
+		unsigned                    d_num_keywords = 0;
+		size_t                      d_state_count = 0;
+		state_ptr_collection        d_states_in_bfs_order;
+		state_ptr_collection        d_final_states_in_bfs_order;
+
+	public:
+		basic_trie(): basic_trie(config()) {}
+
+		explicit basic_trie(const allocator_type& alloc): basic_trie(config(), alloc) {}
+
+		basic_trie(const config& c, const allocator_type& alloc = allocator_type())
+			: d_root(create_root(alloc))
+			, d_config(c)
+			, d_postprocessed(false)
+			, d_compiled(alloc)
+			, d_long_keywords(alloc)
+			, d_keyword_states(alloc)
+			, d_states_in_bfs_order(alloc)
+			, d_final_states_in_bfs_order(alloc) {}
+
+		allocator_type get_allocator() const { return d_root->get_allocator(); }
+
+		// Fold the case of the text, and of keywords inserted from then on, with
+		// fold_case.
+		basic_trie& case_insensitive() {
+			d_config.set_case_insensitive(true);
+			if (d_postprocessed)
+				d_root_skip.assign(*d_root, true);
+			d_engine_generation = 0;
+			d_filter_generation = 0;
+			return (*this);
+		}
+
+		basic_trie& remove_overlaps() {
+			d_config.set_allow_overlaps(false);
+			return (*this);
+		}
+
+		basic_trie& only_whole_words() {
+			d_config.set_only_whole_words(true);
+			return (*this);
+		}
+
+		basic_trie& remove_substrings() {
+			d_config.set_allow_substrings(false);
+			return (*this);
+		}
+		
+		basic_trie& store_states_in_bfs_order() {
+			d_config.set_store_states_in_bfs_order(true);
+			return (*this);
+		}
+
+		// Use up to count threads for building the automaton.
+		basic_trie& thread_count(size_t count) {
+			d_config.set_thread_count(count);
+			return (*this);
+		}
+
+		// Memoize up to size bytes of resolved transitions in each scratch.
+		// Every transition, whether a direct goto transition or one that
+		// follows failure links, is then looked up in the cache first; on a
+		// miss, the result is stored, replacing the entry previously in its
+		// slot.
+		basic_trie& cache_transitions(size_t size) {
+			d_config.set_transition_cache_size(size);
+			return (*this);
+		}
+
+		// Give every state of the compiled automaton a dense row, so that
+		// parse_text never follows failure links. The rows are indexed by
+		// symbol class, which keeps them short for small alphabets. Applies to
+		// one-byte character types; the memory budget passed to compile is
+		// still respected.
+		basic_trie& full_dfa() {
+			d_config.set_full_dfa(true);
+			d_compiled.clear();
+			return (*this);
+		}
+
+		// Store identical dense rows of the compiled automaton once. With
+		// full_dfa, this removes among others the row of every state without
+		// goto transitions, which repeats the row of its failure state.
+		basic_trie& minimize() {
+			d_config.set_minimize(true);
+			d_compiled.clear();
+			return (*this);
+		}
+
+		// Search with the given engine instead of the automaton when possible.
+		// The engine is prepared with the automaton and again after updates.
+		basic_trie& engine(search_engine e) {
+			d_config.set_engine(e);
+			d_engine_generation = 0;
+			return (*this);
+		}
+
+		// Scan only the parts of the text in which every q-gram is one of the
+		// keywords' q-grams, as looked up in a Bloom filter. Pays off when
+		// matches are rare; the emits are the same.
+		basic_trie& qgram_filter() {
+			d_config.set_qgram_filter(true);
+			d_filter_generation = 0;
+			return (*this);
+		}
+
+		// Index keywords longer than length by their first length characters
+		// only, and verify the rest of such a keyword where its prefix is found.
+		// This keeps the automaton small for long keywords. Only applies to
+		// keywords inserted afterwards, and only if substrings are allowed.
+		basic_trie& long_keyword_threshold(size_t length) {
+			d_config.set_long_keyword_threshold(length);
+			return (*this);
+		}
+
+		// Keywords inserted after the automaton has been constructed are added
+		// to it directly, updating only the failure links and emits of the
+		// affected states. If states are stored in BFS order, the automaton
+		// is instead constructed again on next use. If substrings are not
+		// allowed, keywords cannot be added afterwards and nullptr is returned.
+		state_ptr_type insert(string_type keyword) {
+			if (keyword.empty())
+				return d_root.get();
+			if (d_config.is_case_insensitive())
+				keyword = folded(std::move(keyword));
+			if (is_long_keyword(keyword))
+				return insert_long_keyword(std::move(keyword));
+			if (d_postprocessed)
+				return insert_into_automaton(keyword);
+			state_ptr_type cur_state = d_root.get();
+			for (const auto& ch : keyword) {
+				cur_state = cur_state->add_state(ch);
+			}
+			
+			return add_keyword(cur_state, keyword);
+		}
+
+		template<class InputIterator>
+		void insert(InputIterator first, InputIterator last) {
+			for (InputIterator it = first; it != last; ++it) {
+				insert(*it);
+			}
+		}
+
+		// Insert keywords given in ascending order. Each keyword is placed
+		// starting from the state of its longest common prefix with the
+		// previous keyword, and the remaining states are appended without
+		// searching the transition maps. If the range turns out not to be
+		// sorted, the rest of the keywords are inserted without the speed-up,
+		// as are keywords that have to be case-folded or shortened.
+		template<class ForwardIterator>
+		void insert_sorted(ForwardIterator first, ForwardIterator last) {
+			if (d_postprocessed || d_config.get_long_keyword_threshold() || d_config.is_case_insensitive()) {
+				insert(first, last);
+				return;
+			}
+			add_sorted_paths(
+				d_root.get(), 0, first, last,
+				[](ForwardIterator it) -> decltype(*it) { return *it; },
+				[this](ForwardIterator it, state_ptr_type final_state) { add_keyword(final_state, *it); }
+			);
+		}
+
+		// Insert keywords using the configured number of threads. The keywords
+		// are partitioned by their first character and each thread builds the
+		// subtrees of the partitions assigned to it. Keyword indices and emits
+		// are assigned afterwards in the order of the range, so the result is
+		// the same as with insert(first, last). A stateful allocator has to be
+		// thread-safe.
+		template<class RandomAccessIterator>
+		void insert_parallel(RandomAccessIterator first, RandomAccessIterator last) {
+			auto const thread_count = d_config.get_thread_count();
+			auto const count = static_cast<size_t>(last - first);
+			if (thread_count < 2 || d_postprocessed || d_config.get_long_keyword_threshold() || d_config.is_case_insensitive()) {
+				insert(first, last);
+				return;
+			}
+
+			struct partition {
+				state_ptr_type      root = nullptr;
+				std::vector<size_t> keywords;
+			};
+			std::map<CharType, partition> partitions;
+			for (size_t i = 0; i < count; ++i) {
+				const auto& keyword = first[i];
+				if (keyword.empty())
+					continue;
+				auto& part = partitions[keyword[0]];
+				if (part.root == nullptr)
+					part.root = d_root->add_state(keyword[0]);
+				part.keywords.push_back(i);
+			}
+
+			// Assign the largest partitions first, each to the least loaded thread.
+			std::vector<partition*> by_size;
+			for (auto& kv : partitions)
+				by_size.push_back(&kv.second);
+			std::sort(by_size.begin(), by_size.end(), [](const partition* a, const partition* b) -> bool {
+				return a->keywords.size() > b->keywords.size();
+			});
+			std::vector<std::vector<partition*>> assigned(thread_count);
+			std::vector<size_t> load(thread_count, 0);
+			for (auto part : by_size) {
+				auto const idx = std::min_element(load.begin(), load.end()) - load.begin();
+				assigned[idx].push_back(part);
+				load[idx] += part->keywords.size();
+			}
+
+			std::vector<state_ptr_type> final_states(count, nullptr);
+			for_each_chunk(thread_count, thread_count, 1, [&](size_t begin, size_t end, size_t) {
+				for (size_t i = begin; i < end; ++i) {
+					for (auto part : assigned[i]) {
+						add_sorted_paths(
+							part->root, 1, part->keywords.cbegin(), part->keywords.cend(),
+							[&first](std::vector<size_t>::const_iterator it) -> decltype(first[*it]) { return first[*it]; },
+							[&final_states](std::vector<size_t>::const_iterator it, state_ptr_type final_state) { final_states[*it] = final_state; }
+						);
+					}
+				}
+			});
+
+			for (size_t i = 0; i < count; ++i) {
+				if (final_states[i] != nullptr)
+					add_keyword(final_states[i], first[i]);
+			}
+		}
+
+		// Remove every occurrence of keyword. If the automaton has already been
+		// constructed, only the states that emit the keyword are updated, and
+		// states that no longer lead to a keyword are removed.
+		bool erase(const string_type& keyword) {
+			if (keyword.empty())
+				return false;
+			if (d_config.is_case_insensitive()) {
+				auto const folded_keyword = folded(keyword);
+				if (folded_keyword != keyword)
+					return erase(folded_keyword);
+			}
+			if (is_long_keyword(keyword))
+				return erase_long_keyword(keyword);
+			state_ptr_type cur_state = d_root.get();
+			for (const auto& ch : keyword) {
+				cur_state = cur_state->next_state_ignore_root_state(ch);
+				if (cur_state == nullptr)
+					return false;
+			}
+			// The state may only emit the indexed prefixes of long keywords.
+			auto const size = keyword.size();
+			return erase_emits(cur_state, keyword, [this, size](const typename state_type::key_index& e) -> bool {
+				return e.first.size() == size && d_long_keywords.count(e.second) == 0;
+			});
+		}
+
+		// Remove the keyword with the given index as returned by emit::get_index.
+		// Keyword indices are not reused.
+		bool erase_by_index(unsigned index) {
+			if (!d_has_keyword_states) {
+				d_keyword_states.assign(d_num_keywords, nullptr);
+				for_each_state([this](state_ptr_type cur_state) {
+					for (const auto& e : cur_state->get_emits()) {
+						if (e.first.size() == cur_state->get_depth())
+							d_keyword_states[e.second] = cur_state;
+					}
+				});
+				d_has_keyword_states = true;
+			}
+			if (d_keyword_states.size() <= index || d_keyword_states[index] == nullptr)
+				return false;
+
+			auto const cur_state = d_keyword_states[index];
+			string_type keyword;
+			for (const auto& e : cur_state->get_emits()) {
+				if (e.second == index) {
+					keyword.assign(e.first.begin(), e.first.end());
+					break;
+				}
+			}
+			erase_emits(cur_state, keyword, [index](const typename state_type::key_index& e) -> bool {
+				return e.second == index;
+			});
+			d_long_keywords.erase(index);
+			return true;
+		}
+
+		// Construct the automaton and a compiled copy of it that parse_text uses
+		// from then on. The representation of each state's transitions is
+		// chosen from its fanout and depth; dense rows are given to the root and
+		// to high-fanout states, shallowest first, as long as the compiled
+		// automaton fits in memory_budget bytes (0 for no limit). Updating the
+		// automaton afterwards discards the compiled copy; it is compiled again
+		// on the next non-const call to parse_text.
+		basic_trie& compile(size_t memory_budget = 0) {
+			d_config.set_compile(true);
+			d_config.set_memory_budget(memory_budget);
+			d_compiled.clear();
+			check_postprocess();
+			return (*this);
+		}
+
+		bool is_compiled() const { return !d_compiled.empty(); }
+		compiled_automaton const &get_compiled_automaton() const { return d_compiled; }
+		layout_statistics const &get_layout_statistics() const { return d_compiled.get_layout_statistics(); }
+
+		// The engine that the const parse_text currently uses.
+		search_engine active_engine() const {
+			return (is_engine_ready() ? d_active_engine : ENGINE_AUTOMATON);
+		}
+
+		size_t num_keywords() const { return d_num_keywords; }
+		size_t num_states() const { return d_state_count; }
+		
+		state_ptr_type get_root() const { return d_root.get(); }
+		// Discard every keyword, along with the automaton built from them.
+		void reset_root() {
+			d_root = create_root(get_allocator());
+			d_states_in_bfs_order.clear();
+			d_final_states_in_bfs_order.clear();
+			d_has_failure_dependents = false;
+			d_state_count = 0;
+			d_postprocessed = false;
+			d_compiled.clear();
+			d_generation = next_generation();
+			// The engines and the filter hold keywords and states of the old
+			// root; they are prepared again on the next parse.
+			d_engine_generation = 0;
+			d_active_engine = ENGINE_AUTOMATON;
+			d_filter_generation = 0;
+			d_keyword_states.clear();
+			d_has_keyword_states = false;
+			d_long_keywords.clear();
+		}
+		
+		state_ptr_collection const &get_states_in_bfs_order() const { return d_states_in_bfs_order; }
+		state_ptr_collection const &get_final_states_in_bfs_order() const { return d_final_states_in_bfs_order; }
+
+		token_collection tokenise(string_type text) {
+			token_collection tokens;
+			auto collected_emits = parse_text(text);
+			size_t last_pos = interval::max_pos;
+			for (const auto& e : collected_emits) {
+				if (e.get_start() - last_pos > 1) {
+					tokens.push_back(create_fragment(e, text, last_pos));
+				}
+				tokens.push_back(create_match(e, text));
+				last_pos = e.get_end();
+			}
+			if (text.size() - last_pos > 1) {
+				tokens.push_back(create_fragment(typename token_type::emit_type(), text, last_pos));
+			}
+			return token_collection(tokens);
+		}
+
+		emit_collection parse_text(string_type text) {
+			emit_collection collected_emits;
+			scratch s;
+			parse_text(text, collected_emits, s);
+			return collected_emits;
+		}
+
+		// Clears collected_emits and fills it with the matches in text, reusing
+		// the capacity of both collected_emits and s.
+		void parse_text(const string_type& text, emit_collection& collected_emits, scratch& s) {
+			check_postprocess();
+			static_cast<const basic_trie&>(*this).parse_text(text, collected_emits, s);
+		}
+
+		// As above for an automaton that has already been constructed with
+		// check_postprocess. Does not modify the trie, so it may be called from
+		// several threads at once, each with its own scratch.
+		void parse_text(const string_type& text, emit_collection& collected_emits, scratch& s) const {
+			assert(d_postprocessed);
+			collected_emits.clear();
+			auto const cache_mask = prepare_transition_cache(s);
+			if (is_engine_ready()) {
+				find_with_engine(text, collected_emits, s);
+			} else if (is_filter_ready()) {
+				d_filter.for_each_candidate(text, [&](size_t begin, size_t end) {
+					scan(text, begin, end, collected_emits, s, cache_mask);
+				});
+			} else {
+				scan(text, 0, text.size(), collected_emits, s, cache_mask);
+			}
+			if (!d_long_keywords.empty()) {
+				verify_long_keywords(text, collected_emits, s);
+			}
+			if (d_config.is_only_whole_words()) {
+				remove_partial_matches(text, collected_emits);
+			}
+			if (!d_config.is_allow_overlaps()) {
+				remove_overlapping_emits(collected_emits, s);
+			}
+		}
+
+		void check_postprocess() {
+			if (!d_postprocessed) {
+				// Emits may be removed below.
+				d_keyword_states.clear();
+				d_has_keyword_states = false;
+
+				assign_indices();
+
+				if (!d_config.is_allow_substrings())
+					remove_prefixes();
+				
+				construct_failure_states();
+				
+				// construct_failure_states clears emits; store final states
+				// only after doing that.
+				if (d_config.is_store_states_in_bfs_order())
+				{
+					for (auto const cur_state : d_states_in_bfs_order)
+					{
+						if (cur_state->get_emits().size())
+							d_final_states_in_bfs_order.push_back(cur_state);
+					}
+				}
+
+				d_postprocessed = true;
+				d_generation = next_generation();
+				d_root_skip.assign(*d_root, d_config.is_case_insensitive());
+			}
+
+			if (d_config.is_compile() && d_compiled.empty())
+				compile_automaton();
+
+			if (d_config.get_engine() != ENGINE_AUTOMATON && d_engine_generation != d_generation)
+				prepare_engine();
+
+			if (d_config.is_qgram_filter() && d_filter_generation != d_generation)
+				prepare_filter();
+		}
+
+	private:
+		static const uint64_t hash_base = 0x100000001b3ULL;
+
+		// Run the automaton from the root over text[begin, end).
+		void scan(const string_type& text, size_t begin, size_t end, emit_collection& collected_emits, scratch& s, size_t cache_mask) const {
+			size_t pos = begin;
+			state_ptr_type cur_state = d_root.get();
+			if (!d_compiled.empty()) {
+				bool const case_insensitive = d_config.is_case_insensitive();
+				auto const symbol_at = [&text, case_insensitive](size_t i) -> symbol_type {
+					auto c = text[i];
+					if (case_insensitive) {
+						c = fold_case(c);
+					}
+					return static_cast<symbol_type>(c);
+				};
+				uint32_t cur = 0;
+				for (; pos < end; ++pos) {
+					if (cur == 0 && (pos = skip_from_root(text, pos, end)) == end)
+						break;
+					cur = d_compiled.advance(cur, symbol_at, end, pos);
+					d_compiled.store_emits(pos, cur, collected_emits);
+				}
+			} else if (cache_mask) {
+				auto* const cache = s.d_transitions.data();
+				for (; pos < end; ++pos) {
+					if (cur_state == d_root.get() && (pos = skip_from_root(text, pos, end)) == end)
+						break;
+					auto c = text[pos];
+					if (d_config.is_case_insensitive()) {
+						c = fold_case(c);
+					}
+					auto& entry = cache[transition_hash(cur_state, c) & cache_mask];
+					if (entry.from == cur_state && entry.character == c) {
+						cur_state = entry.to;
+					} else {
+						entry.from = cur_state;
+						entry.character = c;
+						cur_state = get_state(cur_state, c);
+						entry.to = cur_state;
+					}
+					store_emits(pos, cur_state, collected_emits);
+				}
+			} else {
+				for (; pos < end; ++pos) {
+					if (cur_state == d_root.get() && (pos = skip_from_root(text, pos, end)) == end)
+						break;
+					auto c = text[pos];
+					if (d_config.is_case_insensitive()) {
+						c = fold_case(c);
+					}
+					cur_state = get_state(cur_state, c);
+					store_emits(pos, cur_state, collected_emits);
+				}
+			}
+		}
+
+		bool is_filter_ready() const {
+			return (!d_filter.empty() && d_filter_generation == d_generation);
+		}
+
+		void prepare_filter() {
+			d_filter_generation = d_generation;
+			// Without substrings the automaton only reports some occurrences.
+			if (d_config.is_allow_substrings())
+				d_filter.assign(collect_keywords(), d_config.is_case_insensitive());
+		}
+
+		keyword_collection collect_keywords() {
+			keyword_collection keywords;
+			for_each_state([&keywords](state_ptr_type cur_state) {
+				for (const auto& e : cur_state->get_emits()) {
+					if (e.first.size() == cur_state->get_depth())
+						keywords.emplace_back(string_type(e.first.begin(), e.first.end()), e.second);
+				}
+			});
+			return keywords;
+		}
+
+		bool is_engine_ready() const {
+			return (d_active_engine != ENGINE_AUTOMATON && d_engine_generation == d_generation);
+		}
+
+		void prepare_engine() {
+			// Shorter windows skip too little to beat the automaton.
+			static const size_t auto_min_window = 16;
+			auto const engine = d_config.get_engine();
+			d_engine_generation = d_generation;
+			d_active_engine = ENGINE_AUTOMATON;
+			// Without substrings the automaton only reports some occurrences.
+			if (!d_config.is_allow_substrings())
+				return;
+
+			auto keywords = collect_keywords();
+			auto const case_insensitive = d_config.is_case_insensitive();
+			if ((engine == ENGINE_SHIFT_OR || engine == ENGINE_AUTO) && d_shift_or.assign(keywords, case_insensitive))
+				d_active_engine = ENGINE_SHIFT_OR;
+			else if ((engine == ENGINE_FIXED_LENGTH || engine == ENGINE_AUTO) && d_fixed_length.assign(keywords, case_insensitive))
+				d_active_engine = ENGINE_FIXED_LENGTH;
+			else if ((engine == ENGINE_WU_MANBER || engine == ENGINE_AUTO) && d_wu_manber.assign(keywords, case_insensitive, d_root.get()) &&
+				(engine != ENGINE_AUTO || auto_min_window <= d_wu_manber.window()))
+				d_active_engine = ENGINE_WU_MANBER;
+			else if (engine == ENGINE_FACTOR && d_factor.assign(std::move(keywords), case_insensitive, get_allocator()))
+				d_active_engine = ENGINE_FACTOR;
+			else if ((engine == ENGINE_TEDDY || engine == ENGINE_AUTO) && d_teddy.assign(std::move(keywords), case_insensitive))
+				d_active_engine = ENGINE_TEDDY;
+		}
+
+		// Collect the emits in the order in which the automaton reports them:
+		// by end position and, among emits that end at the same position, by
+		// length and index.
+		void find_with_engine(const string_type& text, emit_collection& collected_emits, scratch& s) const {
+			switch (d_active_engine) {
+			case ENGINE_SHIFT_OR:
+				// Already in order.
+				d_shift_or.find(text, collected_emits);
+				return;
+			case ENGINE_FIXED_LENGTH:
+				// Already in order.
+				d_fixed_length.find(text, collected_emits);
+				return;
+			case ENGINE_TEDDY:
+				d_teddy.find(text, collected_emits);
+				break;
+			case ENGINE_WU_MANBER:
+				d_wu_manber.find(text, collected_emits);
+				break;
+			case ENGINE_FACTOR:
+				d_factor.find(text, collected_emits, s);
+				break;
+			default:
+				break;
+			}
+			sort_emits(collected_emits);
+		}
+
+		// Sort emits in the order the automaton reports them: by end, then by
+		// length and by index.
+		static void sort_emits(emit_collection& collected_emits) {
+			std::sort(collected_emits.begin(), collected_emits.end(), [](const emit_type& a, const emit_type& b) -> bool {
+				if (a.get_end() != b.get_end())
+					return a.get_end() < b.get_end();
+				if (a.size() != b.size())
+					return a.size() < b.size();
+				return a.get_index() < b.get_index();
+			});
+		}
+
+		static uint64_t hash_symbol(CharType c) {
+			return static_cast<uint64_t>(static_cast<typename std::make_unsigned<CharType>::type>(c)) + 1;
+		}
+
+		// Replace the emits of long keyword prefixes by the long keywords where
+		// the rest of the keyword follows in text, and drop them otherwise.
+		// Hashes of the prefixes of text are computed as far as they are needed.
+		void verify_long_keywords(const string_type& text, emit_collection& collected_emits, scratch& s) const {
+			auto const threshold = d_config.get_long_keyword_threshold();
+			auto const case_insensitive = d_config.is_case_insensitive();
+			auto& hashes = s.d_prefix_hashes;
+			hashes.assign(1, 0);
+			size_t kept = 0;
+			bool extended = false;
+			for (size_t i = 0; i < collected_emits.size(); ++i) {
+				auto const& e = collected_emits[i];
+				auto const it = (e.size() == threshold ? d_long_keywords.find(e.get_index()) : d_long_keywords.end());
+				if (it == d_long_keywords.end()) {
+					if (kept != i)
+						collected_emits[kept] = std::move(collected_emits[i]);
+					++kept;
+					continue;
+				}
+				auto const& lk = it->second;
+				auto const tail = lk.keyword.size() - threshold;
+				auto const begin = e.get_end() + 1;
+				auto const end = begin + tail;
+				if (end > text.size())
+					continue;
+				while (hashes.size() <= end) {
+					auto c = text[hashes.size() - 1];
+					if (case_insensitive) {
+						c = fold_case(c);
+					}
+					hashes.push_back(hashes.back() * hash_base + hash_symbol(c));
+				}
+				if (hashes[end] - hashes[begin] * lk.tail_power != lk.tail_hash)
+					continue;
+				bool equal;
+				if (case_insensitive) {
+					equal = std::equal(lk.keyword.begin() + threshold, lk.keyword.end(), text.begin() + begin, [](CharType k, CharType c) -> bool {
+						return k == fold_case(c);
+					});
+				} else {
+					equal = (0 == std::char_traits<CharType>::compare(text.data() + begin, lk.keyword.data() + threshold, tail));
+				}
+				if (!equal)
+					continue;
+				collected_emits[kept++] = emit_type(e.get_start(), end - 1, typename emit_type::string_type(lk.keyword.data(), lk.keyword.size()), e.get_index());
+				extended = true;
+			}
+			collected_emits.resize(kept);
+			if (extended)
+				sort_emits(collected_emits);
+		}
+
+		// The position of the next symbol in [pos, end) that leaves the root, or end.
+		size_t skip_from_root(const string_type& text, size_t pos, size_t end) const {
+			auto const data = text.data();
+			return d_root_skip.find(data + pos, data + end) - data;
+		}
+
+		static string_type folded(string_type keyword) {
+			for (auto& c : keyword)
+				c = fold_case(c);
+			return keyword;
+		}
+
+		bool is_long_keyword(const string_type& keyword) const {
+			auto const threshold = d_config.get_long_keyword_threshold();
+			return (threshold && keyword.size() > threshold && d_config.is_allow_substrings());
+		}
+
+		state_ptr_type insert_long_keyword(string_type keyword) {
+			auto const threshold = d_config.get_long_keyword_threshold();
+			auto const index = d_num_keywords;
+			auto const final_state = insert(keyword.substr(0, threshold));
+			if (final_state == nullptr || d_num_keywords == index)
+				return final_state;
+
+			long_keyword lk{typename state_type::string_type(keyword.data(), keyword.size(), get_allocator()), 0, 1};
+			for (auto it = lk.keyword.begin() + threshold; it != lk.keyword.end(); ++it) {
+				lk.tail_hash = lk.tail_hash * hash_base + hash_symbol(*it);
+				lk.tail_power *= hash_base;
+			}
+			d_long_keywords.emplace(index, std::move(lk));
+			return final_state;
+		}
+
+		// Remove every occurrence of a keyword that is indexed by its prefix.
+		bool erase_long_keyword(const string_type& keyword) {
+			auto const threshold = d_config.get_long_keyword_threshold();
+			auto const prefix = keyword.substr(0, threshold);
+			state_ptr_type cur_state = d_root.get();
+			for (const auto& ch : prefix) {
+				cur_state = cur_state->next_state_ignore_root_state(ch);
+				if (cur_state == nullptr)
+					return false;
+			}
+			std::vector<unsigned> indices;
+			for (const auto& e : cur_state->get_emits()) {
+				auto const it = d_long_keywords.find(e.second);
+				if (e.first.size() == threshold && it != d_long_keywords.end() && it->second.keyword.compare(0, it->second.keyword.size(), keyword.data(), keyword.size()) == 0)
+					indices.push_back(e.second);
+			}
+			if (indices.empty())
+				return false;
+
+			erase_emits(cur_state, prefix, [&indices](const typename state_type::key_index& e) -> bool {
+				return std::find(indices.begin(), indices.end(), e.second) != indices.end();
+			});
+			for (auto index : indices)
+				d_long_keywords.erase(index);
+			return true;
+		}
+
+		state_ptr_type insert_into_automaton(const string_type& keyword) {
+			if (!d_config.is_allow_substrings())
+				return nullptr;
+
+			if (d_config.is_store_states_in_bfs_order()) {
+				reset_postprocess();
+				return insert(keyword);
+			}
+
+			d_generation = next_generation();
+			d_compiled.clear();
+
+			build_failure_dependents();
+
+			state_ptr_type cur_state = d_root.get();
+			size_t i = 0;
+			for (; i < keyword.size(); ++i) {
+				auto const next = cur_state->next_state_ignore_root_state(keyword[i]);
+				if (next == nullptr)
+					break;
+				cur_state = next;
+			}
+
+			std::vector<state_ptr_type> new_states;
+			for (; i < keyword.size(); ++i) {
+				cur_state = cur_state->add_state(keyword[i]);
+				cur_state->set_index(d_state_count++);
+				new_states.push_back(cur_state);
+			}
+
+			// Link the new states in order of depth. For each new state v = u·c,
+			// the existing states t·c, where u is a proper suffix of t, may now
+			// have v as their longest proper suffix. Such states t are found by
+			// following the failure links backwards from u; the search does not
+			// need to continue below a state that has a transition with c.
+			std::vector<state_ptr_type> stack;
+			for (auto new_state : new_states) {
+				auto const transition = keyword[new_state->get_depth() - 1];
+				auto const parent_state = new_state->parent();
+				state_ptr_type failure_state = d_root.get();
+				if (parent_state != d_root.get()) {
+					failure_state = parent_state->failure();
+					while (failure_state->next_state(transition) == nullptr)
+						failure_state = failure_state->failure();
+					failure_state = failure_state->next_state(transition);
+				}
+				new_state->set_failure(failure_state);
+				failure_state->add_failure_dependent(new_state);
+				new_state->add_failure_emits(failure_state->get_emits());
+
+				stack.assign(parent_state->get_failure_dependents().begin(), parent_state->get_failure_dependents().end());
+				while (!stack.empty()) {
+					auto const suffix_state = stack.back();
+					stack.pop_back();
+					auto const target_state = suffix_state->next_state_ignore_root_state(transition);
+					if (target_state == nullptr) {
+						stack.insert(stack.end(), suffix_state->get_failure_dependents().begin(), suffix_state->get_failure_dependents().end());
+						continue;
+					}
+					// States created by this insertion are linked in their own turn.
+					auto const old_failure_state = target_state->failure();
+					if (old_failure_state != nullptr && old_failure_state->get_depth() < new_state->get_depth()) {
+						old_failure_state->remove_failure_dependent(target_state);
+						target_state->set_failure(new_state);
+						new_state->add_failure_dependent(target_state);
+					}
+				}
+			}
+
+			// The new keyword is emitted by its final state and by every state
+			// that has it as a suffix, i.e. that reaches it by failure links.
+			auto const final_state = cur_state;
+			add_keyword_state(final_state);
+			auto const index = d_num_keywords++;
+			stack.assign(1, final_state);
+			while (!stack.empty()) {
+				auto const suffix_state = stack.back();
+				stack.pop_back();
+				suffix_state->insert_emit(keyword, index);
+				stack.insert(stack.end(), suffix_state->get_failure_dependents().begin(), suffix_state->get_failure_dependents().end());
+			}
+			d_root_skip.assign(*d_root, d_config.is_case_insensitive());
+			return final_state;
+		}
+
+		// Return the trie to the state before check_postprocess. Only valid if
+		// substrings are allowed, since otherwise emits have been removed.
+		void reset_postprocess() {
+			assert(d_config.is_allow_substrings());
+			for_each_state([](state_ptr_type cur_state) {
+				cur_state->clear_failure_emits();
+				cur_state->clear_failure_dependents();
+				cur_state->set_failure(nullptr);
+			});
+			d_states_in_bfs_order.clear();
+			d_final_states_in_bfs_order.clear();
+			d_has_failure_dependents = false;
+			d_postprocessed = false;
+			d_compiled.clear();
+		}
+
+		template <typename Fn>
+		void for_each_state(Fn fn) {
+			std::queue<state_ptr_type> q;
+			q.push(d_root.get());
+			while (!q.empty()) {
+				auto cur_state(q.front());
+				q.pop();
+				fn(cur_state);
+				for (auto state_ptr : cur_state->get_states())
+					q.push(state_ptr);
+			}
+		}
+
+		// Add the states for the keywords in [first, last) below start, which
+		// represents the first offset characters of each of them. Since
+		// consecutive keywords are expected to be in ascending order, each one
+		// continues from the longest common prefix with the previous one and
+		// new states are appended to the transition maps. States that existed
+		// before, apart from a start without transitions, may already have
+		// transitions on greater characters, so their transitions are added with
+		// a regular lookup, as are all remaining states if the order turns out
+		// to be otherwise.
+		template <typename Iterator, typename KeywordFn, typename FinalStateFn>
+		void add_sorted_paths(
+			state_ptr_type start,
+			size_t offset,
+			Iterator first,
+			Iterator last,
+			KeywordFn keyword_of,
+			FinalStateFn on_final_state
+		) {
+			state_ptr_collection path(1, start, get_allocator());
+			// Index in path of the first state created here, if any; its
+			// descendants on the path are new as well.
+			auto const none = std::numeric_limits<size_t>::max();
+			size_t first_new = (0 == start->goto_transition_count() ? 0 : none);
+			Iterator prev = last;
+			bool ordered = true;
+			for (Iterator it = first; it != last; ++it) {
+				const auto& keyword = keyword_of(it);
+				if (keyword.empty())
+					continue;
+
+				size_t common = offset;
+				if (prev != last) {
+					const auto& prev_keyword = keyword_of(prev);
+					auto const limit = std::min(keyword.size(), prev_keyword.size());
+					while (common < limit && keyword[common] == prev_keyword[common])
+						++common;
+					ordered = ordered && (common == prev_keyword.size() ||
+						(common < keyword.size() && prev_keyword[common] < keyword[common]));
+				}
+				prev = it;
+
+				path.resize(common - offset + 1);
+				if (path.size() <= first_new)
+					first_new = none;
+				state_ptr_type cur_state = path.back();
+				for (size_t i = common; i < keyword.size(); ++i) {
+					if (ordered && first_new < path.size()) {
+						cur_state = cur_state->append_state(keyword[i]);
+					} else {
+						auto const next = cur_state->next_state_ignore_root_state(keyword[i]);
+						if (next == nullptr)
+							first_new = std::min(first_new, path.size());
+						cur_state = (next != nullptr ? next : cur_state->add_state(keyword[i]));
+					}
+					path.push_back(cur_state);
+				}
+
+				on_final_state(it, cur_state);
+			}
+		}
+
+		template <typename String>
+		state_ptr_type add_keyword(state_ptr_type cur_state, const String& keyword) {
+			if (0 == cur_state->get_emits().size() || d_config.is_allow_substrings())
+			{
+				add_keyword_state(cur_state);
+				cur_state->add_emit(keyword, d_num_keywords++);
+				return cur_state;
+			}
+
+			return nullptr;
+		}
+
+		void add_keyword_state(state_ptr_type cur_state) {
+			if (d_has_keyword_states)
+				d_keyword_states.push_back(cur_state);
+		}
+
+		// Remove the emits that match pred from final_state, which is the final
+		// state of keyword, and from the states that inherit them through
+		// failure links. Then remove the states that no longer lead to a keyword.
+		// Returns false, and leaves the trie as it is, if no own emit of
+		// final_state matches pred.
+		template <typename Predicate>
+		bool erase_emits(state_ptr_type final_state, const string_type& keyword, Predicate pred) {
+			auto const& emits = final_state->get_emits();
+			auto const depth = final_state->get_depth();
+			if (std::none_of(emits.begin(), emits.end(), [depth, &pred](const typename state_type::key_index& e) -> bool {
+				return e.first.size() == depth && pred(e);
+			}))
+				return false;
+
+			if (d_has_keyword_states) {
+				for (const auto& e : final_state->get_emits()) {
+					if (e.first.size() == final_state->get_depth() && pred(e))
+						d_keyword_states[e.second] = nullptr;
+				}
+			}
+
+			if (!d_postprocessed) {
+				final_state->remove_emits_if(pred);
+				prune_states(final_state, keyword);
+				return true;
+			}
+
+			d_generation = next_generation();
+			d_compiled.clear();
+
+			if (d_config.is_store_states_in_bfs_order()) {
+				if (d_config.is_allow_substrings()) {
+					reset_postprocess();
+					final_state->remove_emits_if(pred);
+					prune_states(final_state, keyword);
+				} else {
+					// Emits are not inherited in this case. Keep the states so that
+					// the stored order stays valid.
+					final_state->remove_emits_if(pred);
+					if (final_state->get_emits().empty()) {
+						auto& final_states = d_final_states_in_bfs_order;
+						final_states.erase(std::find(final_states.begin(), final_states.end(), final_state));
+					}
+				}
+				return true;
+			}
+
+			build_failure_dependents();
+			std::vector<state_ptr_type> stack(1, final_state);
+			while (!stack.empty()) {
+				auto const suffix_state = stack.back();
+				stack.pop_back();
+				suffix_state->remove_emits_if(pred);
+				stack.insert(stack.end(), suffix_state->get_failure_dependents().begin(), suffix_state->get_failure_dependents().end());
+			}
+			prune_states(final_state, keyword);
+			d_root_skip.assign(*d_root, d_config.is_case_insensitive());
+			return true;
+		}
+
+		// Remove final_state and its ancestors up to the first one that has
+		// other transitions or emits its own keyword. States whose failure link
+		// pointed to a removed state get the removed state's failure link.
+		void prune_states(state_ptr_type final_state, const string_type& keyword) {
+			auto cur_state = final_state;
+			while (cur_state != d_root.get() && 0 == cur_state->goto_transition_count() && !cur_state->has_own_emits()) {
+				auto const parent_state = cur_state->parent();
+				if (d_postprocessed) {
+					auto const failure_state = cur_state->failure();
+					failure_state->remove_failure_dependent(cur_state);
+					for (auto dependent : cur_state->get_failure_dependents()) {
+						dependent->set_failure(failure_state);
+						failure_state->add_failure_dependent(dependent);
+					}
+					--d_state_count;
+				}
+				parent_state->remove_state(keyword[cur_state->get_depth() - 1]);
+				cur_state = parent_state;
+			}
+		}
+
+		void build_failure_dependents() {
+			if (!d_has_failure_dependents) {
+				for_each_state([](state_ptr_type cur_state) {
+					if (cur_state->failure() != nullptr)
+						cur_state->failure()->add_failure_dependent(cur_state);
+				});
+				d_has_failure_dependents = true;
+			}
+		}
+
+		static typename state_type::unique_ptr create_root(const allocator_type& alloc) {
+			typename state_type::deleter_type deleter(alloc);
+			return typename state_type::unique_ptr(deleter.create(0, alloc), deleter);
+		}
+
+		token_type create_fragment(const typename token_type::emit_type& e, string_ref_type text, size_t last_pos) const {
+			auto start = last_pos + 1;
 			auto end = (e.is_empty()) ? text.size() : e.get_start();
 			auto len = end - start;
 			typename token_type::string_type str(text.substr(start, len));
@@ -658,22 +2929,332 @@ namespace aho_corasick {
 			return token_type(str, e);
 		}
 
-		void remove_partial_matches(string_ref_type search_text, emit_collection& collected_emits) const {
+		void remove_partial_matches(const string_type& search_text, emit_collection& collected_emits) const {
 			size_t size = search_text.size();
-			emit_collection remove_emits;
-			for (const auto& e : collected_emits) {
-				if ((e.get_start() == 0 || !std::isalpha(search_text.at(e.get_start() - 1))) &&
-					(e.get_end() + 1 == size || !std::isalpha(search_text.at(e.get_end() + 1)))
-					) {
+			auto const it = std::remove_if(collected_emits.begin(), collected_emits.end(), [&](const emit_type& e) -> bool {
+				return !((e.get_start() == 0 || !is_alpha(search_text[e.get_start() - 1])) &&
+					(e.get_end() + 1 == size || !is_alpha(search_text[e.get_end() + 1])));
+			});
+			collected_emits.erase(it, collected_emits.end());
+		}
+
+		// std::isalpha is only defined for the values of unsigned char.
+		static bool is_alpha(CharType c) {
+			auto const u = static_cast<symbol_type>(c);
+			return (u <= std::numeric_limits<unsigned char>::max() && std::isalpha(static_cast<unsigned char>(u)));
+		}
+
+		// Greedily keep the longest (and among equally long ones, the right-most)
+		// emits that do not overlap an already kept one. Emits with identical
+		// spans do not conflict with each other. The kept intervals are disjoint,
+		// so they are stored sorted by start position in the scratch buffer.
+		void remove_overlapping_emits(emit_collection& collected_emits, scratch& s) const {
+			std::sort(collected_emits.begin(), collected_emits.end(), [](const emit_type& a, const emit_type& b) -> bool {
+				if (a.size() == b.size()) {
+					return a.get_start() > b.get_start();
+				}
+				return a.size() > b.size();
+			});
+
+			auto& kept = s.d_kept;
+			kept.clear();
+			size_t count = 0;
+			for (auto& e : collected_emits) {
+				auto it = std::upper_bound(kept.begin(), kept.end(), e);
+				if (it != kept.begin()) {
+					auto const& prev = *(it - 1);
+					if (prev != e && prev.overlaps_with(e)) {
+						continue;
+					}
+				}
+				if (it != kept.end() && it->overlaps_with(e)) {
 					continue;
 				}
-				remove_emits.push_back(e);
+				kept.insert(it, e);
+				std::swap(collected_emits[count++], e);
 			}
-			for (auto& e : remove_emits) {
-				collected_emits.erase(
-					std::find(collected_emits.begin(), collected_emits.end(), e)
-					);
+			collected_emits.erase(collected_emits.begin() + count, collected_emits.end());
+
+			std::sort(collected_emits.begin(), collected_emits.end(), [](const emit_type& a, const emit_type& b) -> bool {
+				if (a.get_start() == b.get_start()) {
+					return a.get_index() < b.get_index();
+				}
+				return a.get_start() < b.get_start();
+			});
+		}
+
+		void compile_automaton() {
+			// Renumber the states in BFS order; updates may have left gaps.
+			std::vector<state_ptr_type> states;
+			for_each_state([&states](state_ptr_type cur_state) {
+				cur_state->set_index(states.size());
+				states.push_back(cur_state);
+			});
+			d_state_count = states.size();
+
+			size_t const dense_min_fanout = (d_config.is_full_dfa() ? 0 : 16);
+			static const size_t bitmap_min_fanout = 9;
+			static const size_t sorted_entry_size = sizeof(symbol_type) + sizeof(uint32_t);
+			static const size_t bitmap_node_size = sizeof(typename compiled_automaton::bitmap_node);
+			bool const can_be_dense = (sizeof(CharType) == 1);
+
+			// Symbols that label no transition behave identically in every
+			// state and share class 0 if there are any. In a trie, any other
+			// two symbols lead to different states somewhere, so each gets a
+			// class of its own.
+			auto& ca = d_compiled;
+			ca.clear();
+			std::vector<symbol_type> class_symbols;
+			if (can_be_dense) {
+				bool used[256] = {};
+				for (auto cur_state : states) {
+					for (auto ch : cur_state->get_transitions())
+						used[static_cast<symbol_type>(ch) & 0xff] = true;
+				}
+				if (std::count(used, used + 256, false))
+					class_symbols.push_back(std::find(used, used + 256, false) - used);
+				for (size_t sym = 0; sym < 256; ++sym) {
+					if (used[sym]) {
+						ca.d_classes[sym] = class_symbols.size();
+						class_symbols.push_back(sym);
+					} else {
+						ca.d_classes[sym] = 0;
+					}
+				}
+				ca.d_statistics.set_class_count(class_symbols.size());
+			}
+			size_t const dense_row_size = class_symbols.size() * sizeof(uint32_t);
+
+			std::unordered_map<unsigned, uint32_t> keyword_slots;
+			size_t bytes = (can_be_dense ? sizeof(ca.d_classes) : 0);
+			for (auto cur_state : states) {
+				for (const auto& e : cur_state->get_emits()) {
+					if (e.first.size() == cur_state->get_depth() && keyword_slots.find(e.second) == keyword_slots.end()) {
+						keyword_slots[e.second] = ca.d_keywords.size();
+						ca.d_keywords.push_back(e.first);
+						ca.d_keyword_indices.push_back(e.second);
+						bytes += sizeof(e.first) + e.first.capacity() * sizeof(CharType) + sizeof(unsigned);
+					}
+				}
+			}
+
+			// Start with the compact representations. Bitmaps replace the sorted
+			// arrays once a linear scan gets too long.
+			std::vector<uint8_t> representations(states.size());
+			std::vector<size_t> compact_sizes(states.size(), 0);
+			std::vector<uint32_t> parents(states.size(), 0);
+			std::vector<bool> kept(states.size(), false);
+			std::vector<bool> resolved(states.size(), false);
+			kept[0] = true;
+			bytes += states.size() * (sizeof(typename compiled_automaton::compiled_state) + sizeof(uint32_t));
+			for (size_t i = 0; i < states.size(); ++i) {
+				auto const cur_state = states[i];
+				auto const fanout = cur_state->goto_transition_count();
+				bytes += cur_state->get_emits().size() * sizeof(uint32_t);
+				if (fanout == 1) {
+					representations[i] = REPRESENTATION_SINGLE;
+				} else if (can_be_dense && bitmap_min_fanout <= fanout) {
+					representations[i] = REPRESENTATION_BITMAP;
+					compact_sizes[i] = bitmap_node_size + fanout * sizeof(uint32_t);
+				} else {
+					representations[i] = REPRESENTATION_SORTED;
+					compact_sizes[i] = fanout * sorted_entry_size;
+				}
+				bytes += compact_sizes[i];
+				for (auto ch : cur_state->get_transitions())
+					parents[cur_state->next_state(ch)->index()] = i;
+				if (cur_state->failure())
+					kept[cur_state->failure()->index()] = true;
+			}
+
+			// Collapse the states on paths where each state has one transition
+			// and no emits. They may only be entered from their parents, so
+			// failure targets, states with dense rows and the children of states
+			// whose transitions are copied into dense rows are kept. A collapsed
+			// state is replaced by a chain entry; counting the entry twice also
+			// covers the chain's end on the state before the path.
+			static const size_t collapse_saving = sizeof(typename compiled_automaton::compiled_state) + sizeof(uint32_t) - 2 * sorted_entry_size;
+			auto const is_collapsed = [&](size_t i) -> bool {
+				auto const parent = parents[i];
+				return (i != 0 && !kept[i] && representations[i] != REPRESENTATION_DENSE &&
+					1 == states[i]->goto_transition_count() && states[i]->get_emits().empty() &&
+					1 == states[parent]->goto_transition_count() && !resolved[parent]);
+			};
+			for (size_t i = 0; i < states.size(); ++i) {
+				if (is_collapsed(i))
+					bytes -= collapse_saving;
+			}
+
+			// Give dense rows to candidates in BFS order while the budget allows,
+			// including the chains they prevent.
+			auto const budget = d_config.get_memory_budget();
+			if (can_be_dense) {
+				std::vector<size_t> lost;
+				for (size_t i = 0; i < states.size(); ++i) {
+					auto const fanout = states[i]->goto_transition_count();
+					if (i != 0 && fanout < dense_min_fanout)
+						continue;
+					lost.clear();
+					if (is_collapsed(i))
+						lost.push_back(i);
+					for (auto s = states[i]; s && !resolved[s->index()]; s = s->failure()) {
+						if (1 == s->goto_transition_count()) {
+							auto const child = s->next_state(s->get_transitions().front())->index();
+							if (child != i && is_collapsed(child))
+								lost.push_back(child);
+						}
+					}
+					auto const cost = dense_row_size + lost.size() * collapse_saving - compact_sizes[i];
+					if (budget && budget < bytes + cost)
+						continue;
+					representations[i] = REPRESENTATION_DENSE;
+					bytes += cost;
+					for (auto s = states[i]; s && !resolved[s->index()]; s = s->failure())
+						resolved[s->index()] = true;
+				}
+			}
+
+			std::vector<bool> collapsed(states.size(), false);
+			std::vector<uint32_t> compiled_indices(states.size());
+			size_t compiled_count = 0;
+			for (size_t i = 0; i < states.size(); ++i) {
+				if (is_collapsed(i)) {
+					collapsed[i] = true;
+					if (!collapsed[parents[i]])
+						representations[parents[i]] = REPRESENTATION_CHAIN;
+				} else {
+					compiled_indices[i] = compiled_count++;
+				}
+			}
+			ca.d_statistics.add_collapsed(states.size() - compiled_count);
+
+			ca.d_states.resize(compiled_count);
+			ca.d_emit_offsets.reserve(compiled_count + 1);
+
+			std::vector<std::pair<symbol_type, uint32_t>> transitions;
+			std::vector<uint32_t> row;
+			std::unordered_multimap<size_t, uint32_t> rows_by_hash;
+			for (size_t i = 0; i < states.size(); ++i) {
+				if (collapsed[i])
+					continue;
+				auto const cur_state = states[i];
+				auto const idx = compiled_indices[i];
+				auto& st = ca.d_states[idx];
+				st.failure = (cur_state->failure() ? compiled_indices[cur_state->failure()->index()] : 0);
+				st.representation = representations[i];
+
+				ca.d_emit_offsets.push_back(ca.d_emits.size());
+				for (const auto& e : cur_state->get_emits())
+					ca.d_emits.push_back(keyword_slots[e.second]);
+
+				transitions.clear();
+				for (auto ch : cur_state->get_transitions())
+					transitions.emplace_back(static_cast<symbol_type>(ch), compiled_indices[cur_state->next_state(ch)->index()]);
+				std::sort(transitions.begin(), transitions.end());
+
+				switch (st.representation) {
+				case REPRESENTATION_DENSE: {
+					st.offset = ca.d_rows.size();
+					st.count = transitions.size();
+					// The failure state precedes this one in BFS order, so its
+					// transitions can already be resolved.
+					row.clear();
+					for (auto sym : class_symbols)
+						row.push_back(idx == 0 ? 0 : ca.next_state(st.failure, sym));
+					for (const auto& t : transitions)
+						row[ca.d_classes[t.first]] = t.second;
+					if (d_config.is_minimize()) {
+						size_t hash = 0;
+						for (auto target : row)
+							hash = hash * 31 + target;
+						auto const range = rows_by_hash.equal_range(hash);
+						auto const it = std::find_if(range.first, range.second, [&ca, &row](const std::pair<const size_t, uint32_t>& r) -> bool {
+							return std::equal(row.begin(), row.end(), ca.d_rows.begin() + r.second);
+						});
+						if (it != range.second) {
+							st.offset = it->second;
+							bytes -= dense_row_size;
+							ca.d_statistics.add_shared_row();
+							break;
+						}
+						rows_by_hash.emplace(hash, st.offset);
+					}
+					ca.d_rows.insert(ca.d_rows.end(), row.begin(), row.end());
+					break;
+				}
+				case REPRESENTATION_SINGLE:
+					st.offset = transitions.front().second;
+					st.count = transitions.front().first;
+					break;
+				case REPRESENTATION_BITMAP: {
+					typename compiled_automaton::bitmap_node node = {};
+					node.children = ca.d_children.size();
+					for (const auto& t : transitions) {
+						node.bits[t.first / 64] |= uint64_t(1) << (t.first % 64);
+						ca.d_children.push_back(t.second);
+					}
+					for (size_t w = 1; w < 4; ++w)
+						node.ranks[w] = node.ranks[w - 1] + popcount(node.bits[w - 1]);
+					st.offset = ca.d_bitmaps.size();
+					st.count = transitions.size();
+					ca.d_bitmaps.push_back(node);
+					break;
+				}
+				case REPRESENTATION_CHAIN: {
+					st.offset = ca.d_chain_symbols.size();
+					auto chain_state = cur_state;
+					do {
+						auto const ch = chain_state->get_transitions().front();
+						chain_state = chain_state->next_state(ch);
+						auto const chain_idx = chain_state->index();
+						ca.d_chain_symbols.push_back(static_cast<symbol_type>(ch));
+						ca.d_chain_states.push_back(compiled_indices[collapsed[chain_idx] ? chain_state->failure()->index() : chain_idx]);
+					} while (collapsed[chain_state->index()]);
+					st.count = ca.d_chain_symbols.size() - st.offset;
+					break;
+				}
+				default:
+					st.offset = ca.d_symbols.size();
+					st.count = transitions.size();
+					for (const auto& t : transitions) {
+						ca.d_symbols.push_back(t.first);
+						ca.d_targets.push_back(t.second);
+					}
+					break;
+				}
+				ca.d_statistics.add_state(static_cast<transition_representation>(st.representation));
+			}
+			ca.d_emit_offsets.push_back(ca.d_emits.size());
+			ca.d_statistics.add_bytes(bytes);
+		}
+
+		// Identifies the shape of the automaton, so that cached transitions can
+		// be invalidated when it changes. Unique across tries.
+		static uint64_t next_generation() {
+			static std::atomic<uint64_t> generation(0);
+			return ++generation;
+		}
+
+		static size_t transition_hash(state_ptr_type cur_state, CharType c) {
+			auto const h = (reinterpret_cast<uintptr_t>(cur_state) >> 4) ^ (static_cast<uintptr_t>(c) << 7);
+			return static_cast<size_t>(h * UINT64_C(0x9E3779B97F4A7C15) >> 16);
+		}
+
+		// Size the transition cache of s for this automaton and return the mask
+		// for its slots, or zero if caching is disabled.
+		size_t prepare_transition_cache(scratch& s) const {
+			auto const size = d_config.get_transition_cache_size();
+			size_t slots = 1;
+			while (2 * slots * sizeof(typename scratch::cached_transition) <= size)
+				slots *= 2;
+			if (slots < 2)
+				return 0;
+
+			if (s.d_transitions.size() != slots || s.d_generation != d_generation) {
+				s.d_transitions.assign(slots, typename scratch::cached_transition());
+				s.d_generation = d_generation;
 			}
+			return slots - 1;
 		}
 
 		state_ptr_type get_state(state_ptr_type cur_state, CharType c) const {
@@ -746,7 +3327,93 @@ namespace aho_corasick {
 			}
 		}
 
+		// Call fn(begin, end, thread_idx) for consecutive chunks of [0, count)
+		// on up to thread_count threads, one of which is the calling thread.
+		template <typename Fn>
+		static void for_each_chunk(size_t count, size_t thread_count, size_t min_chunk_size, Fn fn) {
+			thread_count = std::max(size_t(1), std::min(thread_count, count / std::max(size_t(1), min_chunk_size)));
+			if (thread_count == 1) {
+				fn(size_t(0), count, size_t(0));
+				return;
+			}
+
+			std::vector<std::thread> threads;
+			std::vector<std::exception_ptr> errors(thread_count);
+			auto const chunk_size = (count + thread_count - 1) / thread_count;
+			for (size_t i = 1; i < thread_count; ++i) {
+				auto const begin = std::min(count, i * chunk_size);
+				auto const end = std::min(count, begin + chunk_size);
+				threads.emplace_back([&fn, &errors, begin, end, i]() {
+					try {
+						fn(begin, end, i);
+					} catch (...) {
+						errors[i] = std::current_exception();
+					}
+				});
+			}
+			try {
+				fn(size_t(0), std::min(count, chunk_size), size_t(0));
+			} catch (...) {
+				errors[0] = std::current_exception();
+			}
+			for (auto& t : threads)
+				t.join();
+			for (auto const& e : errors) {
+				if (e)
+					std::rethrow_exception(e);
+			}
+		}
+
 		void construct_failure_states() {
+			// The failure links of the states at depth d only depend on states
+			// at smaller depths, so each level can be handled in parallel. When
+			// substrings are not allowed, the construction modifies the emits
+			// of the failure states, so it is done serially.
+			if (1 < d_config.get_thread_count() && d_config.is_allow_substrings())
+				construct_failure_states_by_level();
+			else
+				construct_failure_states_serially();
+		}
+
+		void construct_failure_states_by_level() {
+			auto const thread_count = d_config.get_thread_count();
+			std::vector<state_ptr_type> level;
+			for (auto depth_one_state : d_root->get_states()) {
+				depth_one_state->set_failure(d_root.get());
+				level.push_back(depth_one_state);
+			}
+
+			std::vector<std::vector<state_ptr_type>> next_levels(thread_count);
+			while (!level.empty()) {
+				for (auto& next : next_levels)
+					next.clear();
+
+				for_each_chunk(level.size(), thread_count, 256, [&](size_t begin, size_t end, size_t thread_idx) {
+					auto& next = next_levels[thread_idx];
+					for (size_t i = begin; i < end; ++i) {
+						auto cur_state = level[i];
+						for (const auto& transition : cur_state->get_transitions()) {
+							state_ptr_type target_state = cur_state->next_state(transition);
+							next.push_back(target_state);
+
+							state_ptr_type trace_failure_state = cur_state->failure();
+							while (trace_failure_state->next_state(transition) == nullptr) {
+								trace_failure_state = trace_failure_state->failure();
+							}
+							state_ptr_type new_failure_state = trace_failure_state->next_state(transition);
+							target_state->set_failure(new_failure_state);
+							target_state->add_failure_emits(new_failure_state->get_emits());
+						}
+					}
+				});
+
+				level.clear();
+				for (const auto& next : next_levels)
+					level.insert(level.end(), next.begin(), next.end());
+			}
+		}
+
+		void construct_failure_states_serially() {
 			std::queue<state_ptr_type> q;
 			for (auto depth_one_state : d_root->get_states()) {
 				depth_one_state->set_failure(d_root.get());
@@ -778,7 +3445,7 @@ namespace aho_corasick {
 						}
 
 						target_state->set_failure(new_failure_state);
-						target_state->add_emit(new_failure_state->get_emits());
+						target_state->add_failure_emits(new_failure_state->get_emits());
 						break;
 					}
 				}
@@ -787,18 +3454,387 @@ namespace aho_corasick {
 		}
 
 		void store_emits(size_t pos, state_ptr_type cur_state, emit_collection& collected_emits) const {
-			auto emits = cur_state->get_emits();
-			if (!emits.empty()) {
-				for (const auto& str : emits) {
-					auto emit_str = typename emit_type::string_type(str.first);
-					collected_emits.push_back(emit_type(pos - emit_str.size() + 1, pos, emit_str, str.second));
-				}
+			for (const auto& str : cur_state->get_emits()) {
+				collected_emits.emplace_back(
+					pos - str.first.size() + 1,
+					pos,
+					typename emit_type::string_type(str.first.data(), str.first.size()),
+					str.second
+				);
 			}
 		}
 	};
 
+	// Publishes tries to threads that scan with them while they are replaced.
+	// Readers take a snapshot and scan it with the const parse_text; publish
+	// swaps in a new trie atomically, so a reader never waits for a reload
+	// and keeps using its snapshot until it releases it. Replaced tries are
+	// destroyed by the publishing thread (in publish or reclaim) once no
+	// snapshot refers to them, so readers do not pay for the destruction.
+	template <typename Trie>
+	class trie_handle {
+	public:
+		typedef Trie                          trie_type;
+		typedef std::shared_ptr<const Trie>   snapshot_type;
+
+	private:
+		snapshot_type               d_trie;
+		std::atomic<uint64_t>       d_version;
+		std::mutex                  d_publish_mutex;
+		std::vector<snapshot_type>  d_retired;
+
+	public:
+		trie_handle(): trie_handle(Trie()) {}
+
+		explicit trie_handle(Trie&& trie)
+			: d_trie(prepare(std::make_shared<Trie>(std::move(trie))))
+			, d_version(0) {}
+
+		trie_handle(const trie_handle&) = delete;
+		trie_handle& operator=(const trie_handle&) = delete;
+
+		snapshot_type snapshot() const { return std::atomic_load(&d_trie); }
+
+		// Incremented by each publish.
+		uint64_t version() const { return d_version.load(); }
+
+		void publish(Trie&& trie) {
+			publish(std::make_shared<Trie>(std::move(trie)));
+		}
+
+		void publish(std::shared_ptr<Trie> trie) {
+			// Construct the automaton before readers can see the trie.
+			auto next = prepare(std::move(trie));
+			std::lock_guard<std::mutex> lock(d_publish_mutex);
+			auto prev = std::atomic_exchange(&d_trie, next);
+			++d_version;
+			d_retired.push_back(std::move(prev));
+			reclaim_retired();
+		}
+
+		// Destroy the replaced tries that are no longer used by any reader.
+		void reclaim() {
+			std::lock_guard<std::mutex> lock(d_publish_mutex);
+			reclaim_retired();
+		}
+
+		size_t retired_count() {
+			std::lock_guard<std::mutex> lock(d_publish_mutex);
+			return d_retired.size();
+		}
+
+	private:
+		static snapshot_type prepare(std::shared_ptr<Trie> trie) {
+			trie->check_postprocess();
+			return snapshot_type(std::move(trie));
+		}
+
+		void reclaim_retired() {
+			// A retired trie cannot be snapshotted again, so once the retired
+			// list holds the only reference, it stays that way.
+			d_retired.erase(std::remove_if(d_retired.begin(), d_retired.end(), [](const snapshot_type& t) -> bool {
+				return t.use_count() == 1;
+			}), d_retired.end());
+		}
+	};
+
 	typedef basic_trie<char>     trie;
 	typedef basic_trie<wchar_t>  wtrie;
+	typedef basic_trie<char16_t, hashed_transition_map> u16trie;
+	typedef basic_trie<char32_t, hashed_transition_map> u32trie;
+
+	// A trie of Unicode keywords that scans UTF-8 text directly. Keywords are
+	// stored as UTF-8 in a byte trie, so the text is neither decoded nor
+	// widened, and emits hold byte offsets and UTF-8 keywords. If case
+	// insensitive, keywords and text are folded per code point with
+	// fold_code_point; the folded text is written to the scratch and the
+	// emits are mapped back to offsets in the original text. Invalid UTF-8
+	// in the text is matched as it is.
+	class utf8_trie {
+	public:
+		typedef trie::emit_type       emit_type;
+		typedef trie::emit_collection emit_collection;
+
+		// Working memory for parse_text; see basic_trie::scratch.
+		class scratch {
+			friend class utf8_trie;
+
+			trie::scratch                          d_trie;
+			std::string                            d_folded;
+			// Positions in the folded and the original text after each code
+			// point whose folded form has another length.
+			std::vector<std::pair<size_t, size_t>> d_offsets;
+		};
+
+	private:
+		trie d_trie;
+		bool d_case_insensitive = false;
+		bool d_only_whole_words = false;
+
+	public:
+		// The byte trie, for inspection. Its case_insensitive and
+		// only_whole_words work on bytes and would break up code points, so
+		// it is only configured through the members below.
+		const trie& get_trie() const { return d_trie; }
+
+		utf8_trie& case_insensitive() {
+			d_case_insensitive = true;
+			return (*this);
+		}
+
+		// Drop emits next to a letter, looking at whole code points.
+		utf8_trie& only_whole_words() {
+			d_only_whole_words = true;
+			return (*this);
+		}
+
+		// See basic_trie::compile.
+		utf8_trie& compile(size_t memory_budget = 0) {
+			d_trie.compile(memory_budget);
+			return (*this);
+		}
+
+		// See basic_trie::engine.
+		utf8_trie& engine(search_engine e) {
+			d_trie.engine(e);
+			return (*this);
+		}
+
+		void insert(const std::string& keyword) { d_trie.insert(prepare(keyword)); }
+		void insert(const std::u32string& keyword) { d_trie.insert(encode(keyword)); }
+		void insert(const std::wstring& keyword) { d_trie.insert(encode(keyword)); }
+
+		template<class InputIterator>
+		void insert(InputIterator first, InputIterator last) {
+			for (InputIterator it = first; it != last; ++it) {
+				insert(*it);
+			}
+		}
+
+		bool erase(const std::string& keyword) { return d_trie.erase(prepare(keyword)); }
+		bool erase(const std::u32string& keyword) { return d_trie.erase(encode(keyword)); }
+		bool erase(const std::wstring& keyword) { return d_trie.erase(encode(keyword)); }
+
+		size_t num_keywords() const { return d_trie.num_keywords(); }
+
+		void check_postprocess() { d_trie.check_postprocess(); }
+
+		emit_collection parse_text(const std::string& text) {
+			emit_collection collected_emits;
+			scratch s;
+			parse_text(text, collected_emits, s);
+			return collected_emits;
+		}
+
+		void parse_text(const std::string& text, emit_collection& collected_emits, scratch& s) {
+			d_trie.check_postprocess();
+			static_cast<const utf8_trie&>(*this).parse_text(text, collected_emits, s);
+		}
+
+		void parse_text(const std::string& text, emit_collection& collected_emits, scratch& s) const {
+			if (!d_case_insensitive) {
+				d_trie.parse_text(text, collected_emits, s.d_trie);
+			} else {
+				fold(text, s);
+				d_trie.parse_text(s.d_folded, collected_emits, s.d_trie);
+				if (!s.d_offsets.empty()) {
+					for (auto& e : collected_emits) {
+						e = emit_type(original_offset(s, e.get_start()), original_offset(s, e.get_end() + 1) - 1, e.get_keyword(), e.get_index());
+					}
+				}
+			}
+			if (d_only_whole_words) {
+				remove_partial_matches(text, collected_emits);
+			}
+		}
+
+		// Replace the byte offsets of emits in text by code point offsets.
+		static void to_code_point_offsets(const std::string& text, emit_collection& collected_emits) {
+			// The code point index of a byte offset is the number of lead bytes
+			// before it; count them once up to each offset that is needed.
+			std::vector<size_t> offsets;
+			for (const auto& e : collected_emits) {
+				offsets.push_back(e.get_start());
+				offsets.push_back(e.get_end() + 1);
+			}
+			std::sort(offsets.begin(), offsets.end());
+			offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+			std::vector<size_t> counts(offsets.size());
+			size_t pos = 0;
+			size_t count = 0;
+			for (size_t i = 0; i < offsets.size(); ++i) {
+				for (; pos < offsets[i]; ++pos)
+					count += ((static_cast<uint8_t>(text[pos]) & 0xc0) != 0x80);
+				counts[i] = count;
+			}
+			auto const code_point_offset = [&offsets, &counts](size_t offset) -> size_t {
+				return counts[std::lower_bound(offsets.begin(), offsets.end(), offset) - offsets.begin()];
+			};
+			for (auto& e : collected_emits) {
+				e = emit_type(code_point_offset(e.get_start()), code_point_offset(e.get_end() + 1) - 1, e.get_keyword(), e.get_index());
+			}
+		}
+
+	private:
+		static const uint32_t invalid_code_point = 0xffffffff;
+
+		// The code point starting at pos, which is moved past it, or
+		// invalid_code_point for a byte that does not start valid UTF-8.
+		static uint32_t decode(const std::string& text, size_t& pos) {
+			auto const lead = static_cast<uint8_t>(text[pos]);
+			size_t length;
+			uint32_t cp;
+			if (lead < 0x80) {
+				++pos;
+				return lead;
+			} else if (lead >= 0xc2 && lead < 0xe0) {
+				length = 2;
+				cp = lead & 0x1f;
+			} else if (lead >= 0xe0 && lead < 0xf0) {
+				length = 3;
+				cp = lead & 0x0f;
+			} else if (lead >= 0xf0 && lead < 0xf5) {
+				length = 4;
+				cp = lead & 0x07;
+			} else {
+				return invalid_code_point;
+			}
+			if (text.size() - pos < length)
+				return invalid_code_point;
+			for (size_t i = 1; i < length; ++i) {
+				auto const byte = static_cast<uint8_t>(text[pos + i]);
+				if ((byte & 0xc0) != 0x80)
+					return invalid_code_point;
+				cp = (cp << 6) | (byte & 0x3f);
+			}
+			// Overlong forms, surrogates and code points past U+10FFFF.
+			if ((length == 3 && cp < 0x800) || (length == 4 && (cp < 0x10000 || 0x110000 <= cp)) || (0xd800 <= cp && cp < 0xe000))
+				return invalid_code_point;
+			pos += length;
+			return cp;
+		}
+
+		// Whether a code point counts as a letter for only_whole_words. There
+		// is no table of letters; ASCII letters and every valid code point past
+		// ASCII count, except for the Latin-1 punctuation and signs, general
+		// punctuation and symbols, CJK punctuation, fullwidth ASCII
+		// punctuation and emoji.
+		static bool is_letter(uint32_t cp) {
+			if (cp < 0x80)
+				return static_cast<unsigned>((cp | 0x20) - 'a') < 26;
+			return !(cp == invalid_code_point ||
+				cp < 0xc0 || cp == 0xd7 || cp == 0xf7 ||
+				(0x2000 <= cp && cp < 0x2c00) ||
+				(0x3000 <= cp && cp < 0x3040) ||
+				(0xff00 <= cp && cp < 0xff10) || (0xff1a <= cp && cp < 0xff21) ||
+				(0x1f000 <= cp && cp < 0x1fb00));
+		}
+
+		static void remove_partial_matches(const std::string& text, emit_collection& collected_emits) {
+			auto const it = std::remove_if(collected_emits.begin(), collected_emits.end(), [&text](const emit_type& e) -> bool {
+				size_t pos = e.get_end() + 1;
+				if (pos < text.size() && is_letter(decode(text, pos)))
+					return true;
+				if (e.get_start() == 0)
+					return false;
+				// Step back over up to three continuation bytes to the lead byte
+				// of the preceding code point; it counts only if it ends where
+				// the emit starts.
+				pos = e.get_start() - 1;
+				for (size_t i = 0; i < 3 && pos > 0 && (static_cast<uint8_t>(text[pos]) & 0xc0) == 0x80; ++i)
+					--pos;
+				auto const cp = decode(text, pos);
+				return (pos == e.get_start() && is_letter(cp));
+			});
+			collected_emits.erase(it, collected_emits.end());
+		}
+
+		static void append(std::string& out, uint32_t cp) {
+			if (cp < 0x80) {
+				out += static_cast<char>(cp);
+			} else if (cp < 0x800) {
+				out += static_cast<char>(0xc0 | (cp >> 6));
+				out += static_cast<char>(0x80 | (cp & 0x3f));
+			} else if (cp < 0x10000) {
+				out += static_cast<char>(0xe0 | (cp >> 12));
+				out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+				out += static_cast<char>(0x80 | (cp & 0x3f));
+			} else {
+				out += static_cast<char>(0xf0 | (cp >> 18));
+				out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+				out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+				out += static_cast<char>(0x80 | (cp & 0x3f));
+			}
+		}
+
+		std::string encode(const std::u32string& keyword) const {
+			std::string result;
+			for (auto cp : keyword)
+				append(result, d_case_insensitive ? fold_code_point(cp) : static_cast<uint32_t>(cp));
+			return result;
+		}
+
+		// wchar_t holds UTF-16 where it has 16 bits.
+		std::string encode(const std::wstring& keyword) const {
+			std::u32string code_points;
+			for (size_t i = 0; i < keyword.size(); ++i) {
+				auto cp = static_cast<uint32_t>(keyword[i]);
+				if (sizeof(wchar_t) == 2 && 0xd800 <= cp && cp < 0xdc00 && i + 1 < keyword.size()) {
+					auto const low = static_cast<uint32_t>(keyword[i + 1]);
+					if (0xdc00 <= low && low < 0xe000) {
+						cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+						++i;
+					}
+				}
+				code_points += static_cast<char32_t>(cp);
+			}
+			return encode(code_points);
+		}
+
+		std::string prepare(const std::string& keyword) const {
+			if (!d_case_insensitive)
+				return keyword;
+			scratch s;
+			fold(keyword, s);
+			return s.d_folded;
+		}
+
+		void fold(const std::string& text, scratch& s) const {
+			auto& folded = s.d_folded;
+			folded.clear();
+			s.d_offsets.clear();
+			size_t pos = 0;
+			while (pos < text.size()) {
+				auto const byte = static_cast<uint8_t>(text[pos]);
+				if (byte < 0x80) {
+					folded += static_cast<char>(static_cast<unsigned>(byte - 'A') < 26 ? byte + ('a' - 'A') : byte);
+					++pos;
+					continue;
+				}
+				auto const start = pos;
+				auto const cp = decode(text, pos);
+				if (cp == invalid_code_point) {
+					folded += text[pos++];
+					continue;
+				}
+				auto const folded_start = folded.size();
+				append(folded, fold_code_point(cp));
+				if (folded.size() - folded_start != pos - start)
+					s.d_offsets.emplace_back(folded.size(), pos);
+			}
+		}
+
+		static size_t original_offset(const scratch& s, size_t offset) {
+			auto const& offsets = s.d_offsets;
+			auto it = std::upper_bound(offsets.begin(), offsets.end(), offset, [](size_t value, const std::pair<size_t, size_t>& p) -> bool {
+				return value < p.first;
+			});
+			if (it == offsets.begin())
+				return offset;
+			--it;
+			return it->second + (offset - it->first);
+		}
+	};
 
 
 } // namespace aho_corasick
@@ -52,7 +52,7 @@ size_t bench_naive(vector<string> text_strings, vector<string> patterns) {
 		for (auto& pattern : patterns) {
 			size_t pos = text.find(pattern);
 			while (pos != text.npos) {
-				pos = text.find(pattern, pos);
+				pos = text.find(pattern, pos + 1);
 				count++;
 			}
 		}
@@ -90,12 +90,17 @@ int main(int argc, char** argv) {
 
 	cout << "Generating trie ...";
 	trie t;
-	for (auto& pattern : patterns) {
-		t.insert(pattern);
-	}
+	t.insert_sorted(patterns.begin(), patterns.end());
+	t.parse_text(string());
+	cout << " done" << endl;
+
+	cout << "Generating fixed length trie ...";
+	trie fixed;
+	fixed.engine(ac::ENGINE_FIXED_LENGTH).insert_sorted(patterns.begin(), patterns.end());
+	fixed.parse_text(string());
 	cout << " done" << endl;
 
-	map<size_t, tuple<chrono::high_resolution_clock::duration, chrono::high_resolution_clock::duration>> timings;
+	map<size_t, tuple<chrono::high_resolution_clock::duration, chrono::high_resolution_clock::duration, chrono::high_resolution_clock::duration>> timings;
 
 	cout << "Running ";
 	for (size_t i = 10; i > 0; --i) {
@@ -110,19 +115,25 @@ int main(int argc, char** argv) {
 		end_time = chrono::high_resolution_clock::now();
 		auto time_2 = end_time - start_time;
 
-		if (count_1 != count_2) {
+		start_time = chrono::high_resolution_clock::now();
+		size_t count_3 = bench_aho_corasick(input_vector, fixed);
+		end_time = chrono::high_resolution_clock::now();
+		auto time_3 = end_time - start_time;
+
+		if (count_1 != count_2 || count_1 != count_3) {
 			cout << "failed" << endl;
 		}
 
-		timings[i] = make_tuple(time_1, time_2);
+		timings[i] = make_tuple(time_1, time_2, time_3);
 	}
 	cout << " done" << endl;
 
 	cout << "Results: " << endl;
 	for (auto& i : timings) {
 		cout << "  loop #" << i.first;
-		cout << ", naive: " << chrono::duration_cast<chrono::milliseconds>(get<0>(i.second)).count();
-		cout << "ms, ac: " << chrono::duration_cast<chrono::milliseconds>(get<1>(i.second)).count() << "ms";
+		cout << ", naive: " << chrono::duration_cast<chrono::microseconds>(get<0>(i.second)).count();
+		cout << "us, ac: " << chrono::duration_cast<chrono::microseconds>(get<1>(i.second)).count();
+		cout << "us, fixed length: " << chrono::duration_cast<chrono::microseconds>(get<2>(i.second)).count() << "us";
 		cout << endl;
 	}
 
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2015 Christopher Gilbert.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define CATCH_CONFIG_MAIN
+#include "../test/catch.hpp"
+
+#include "aho_corasick/aho_corasick.hpp"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ac = aho_corasick;
+
+TEST_CASE("trie_handle works as required", "[trie_handle]") {
+	SECTION("publish replaces the trie") {
+		ac::trie t;
+		t.insert("hers");
+		ac::trie_handle<ac::trie> handle(std::move(t));
+		REQUIRE(0 == handle.version());
+
+		ac::trie::emit_collection emits;
+		ac::trie::scratch s;
+		auto old_snapshot = handle.snapshot();
+		old_snapshot->parse_text("ushers", emits, s);
+		REQUIRE(1 == emits.size());
+
+		ac::trie u;
+		u.insert("hers");
+		u.insert("she");
+		handle.publish(std::move(u));
+		REQUIRE(1 == handle.version());
+		REQUIRE(1 == handle.retired_count());
+
+		handle.snapshot()->parse_text("ushers", emits, s);
+		REQUIRE(2 == emits.size());
+		old_snapshot->parse_text("ushers", emits, s);
+		REQUIRE(1 == emits.size());
+
+		old_snapshot.reset();
+		handle.reclaim();
+		REQUIRE(0 == handle.retired_count());
+	}
+	SECTION("readers scan while tries are published") {
+		ac::trie_handle<ac::trie> handle;
+		std::atomic<bool> done(false);
+		std::atomic<size_t> scans(0);
+		std::atomic<bool> consistent(true);
+
+		std::vector<std::thread> readers;
+		for (size_t i = 0; i < 4; ++i) {
+			readers.emplace_back([&]() {
+				ac::trie::emit_collection emits;
+				ac::trie::scratch s;
+				while (!done.load()) {
+					auto snapshot = handle.snapshot();
+					snapshot->parse_text("aaaaaaaaaa", emits, s);
+					// Trie n contains the keywords a, aa, ..., a^n.
+					auto const n = snapshot->num_keywords();
+					size_t expected = 0;
+					for (size_t len = 1; len <= n; ++len)
+						expected += 10 - len + 1;
+					if (emits.size() != expected)
+						consistent.store(false);
+					++scans;
+				}
+			});
+		}
+
+		for (size_t n = 1; n <= 10; ++n) {
+			ac::trie t;
+			for (size_t len = 1; len <= n; ++len)
+				t.insert(std::string(len, 'a'));
+			handle.publish(std::move(t));
+			std::this_thread::yield();
+		}
+		while (scans.load() < 100)
+			std::this_thread::yield();
+		done.store(true);
+		for (auto& reader : readers)
+			reader.join();
+
+		REQUIRE(consistent.load());
+		REQUIRE(10 == handle.version());
+		handle.reclaim();
+		REQUIRE(0 == handle.retired_count());
+	}
+}
@@ -24,10 +24,87 @@
 #include "../test/catch.hpp"
 
 #include "aho_corasick/aho_corasick.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <random>
 #include <string>
+#include <vector>
 
 namespace ac = aho_corasick;
 
+// Counts the allocations made through the global operator new.
+static std::atomic<size_t> allocation_count(0);
+
+void* operator new(std::size_t size) {
+	++allocation_count;
+	if (void* ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+namespace {
+	std::vector<std::string> random_strings(size_t count, size_t min_length, size_t max_length, const std::string& alphabet, unsigned seed) {
+		std::mt19937 gen(seed);
+		std::uniform_int_distribution<size_t> length_dist(min_length, max_length);
+		std::uniform_int_distribution<size_t> char_dist(0, alphabet.size() - 1);
+		std::vector<std::string> result;
+		for (size_t i = 0; i < count; ++i) {
+			std::string str(length_dist(gen), ' ');
+			for (auto& c : str)
+				c = alphabet[char_dist(gen)];
+			result.push_back(str);
+		}
+		return result;
+	}
+
+	template <typename ExpectedTrie, typename Trie>
+	bool same_emits(ExpectedTrie& expected_trie, Trie& trie, const typename Trie::string_type& text) {
+		auto const expected = expected_trie.parse_text(text);
+		auto const emits = trie.parse_text(text);
+		if (expected.size() != emits.size())
+			return false;
+		for (size_t i = 0; i < emits.size(); ++i) {
+			if (expected[i] != emits[i] || expected[i].get_index() != emits[i].get_index() || expected[i].get_keyword() != emits[i].get_keyword())
+				return false;
+		}
+		return true;
+	}
+
+	template <typename T>
+	class counting_allocator {
+	public:
+		typedef T value_type;
+
+		size_t* d_bytes;
+
+		explicit counting_allocator(size_t* bytes): d_bytes(bytes) {}
+
+		template <typename U>
+		counting_allocator(const counting_allocator<U>& other): d_bytes(other.d_bytes) {}
+
+		T* allocate(size_t n) {
+			*d_bytes += n * sizeof(T);
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		}
+
+		void deallocate(T* p, size_t n) {
+			*d_bytes -= n * sizeof(T);
+			::operator delete(p);
+		}
+
+		template <typename U>
+		bool operator==(const counting_allocator<U>& other) const { return d_bytes == other.d_bytes; }
+
+		template <typename U>
+		bool operator!=(const counting_allocator<U>& other) const { return d_bytes != other.d_bytes; }
+	};
+}
+
 TEST_CASE("trie works as required", "[trie]") {
 	auto check_emit = [](const ac::emit<char>& next, size_t expect_start, size_t expect_end, std::string expect_keyword) -> void {
 		REQUIRE(expect_start == next.get_start());
@@ -84,6 +161,825 @@ TEST_CASE("trie works as required", "[trie]") {
 		check_emit(*it++, 1, 3, "she");
 		check_emit(*it++, 2, 5, "hers");
 	}
+	SECTION("insert sorted range") {
+		std::vector<std::string> keywords{"he", "hers", "his", "she"};
+		ac::trie t;
+		t.insert_sorted(keywords.begin(), keywords.end());
+		REQUIRE(4 == t.num_keywords());
+
+		auto emits = t.parse_text("ushers");
+		REQUIRE(3 == emits.size());
+
+		auto it = emits.begin();
+		check_emit(*it++, 2, 3, "he");
+		check_emit(*it++, 1, 3, "she");
+		check_emit(*it++, 2, 5, "hers");
+	}
+	SECTION("insert unsorted range") {
+		std::vector<std::string> keywords{"c", "cz", "b", "cy", "his", "he"};
+		ac::trie t;
+		t.insert_sorted(keywords.begin(), keywords.end());
+		ac::trie u;
+		u.insert(keywords.begin(), keywords.end());
+		REQUIRE(6 == t.num_keywords());
+		REQUIRE(6 == u.num_keywords());
+
+		auto emits = t.parse_text("bcyczhishe");
+		auto expected = u.parse_text("bcyczhishe");
+		REQUIRE(7 == emits.size());
+		REQUIRE(expected.size() == emits.size());
+		for (size_t i = 0; i < emits.size(); ++i) {
+			check_emit(emits[i], expected[i].get_start(), expected[i].get_end(), expected[i].get_keyword());
+			REQUIRE(expected[i].get_index() == emits[i].get_index());
+		}
+	}
+	SECTION("insert sorted range into a non-empty trie") {
+		auto const keywords = random_strings(500, 1, 6, "abc", 55);
+		auto sorted_keywords = random_strings(500, 1, 6, "abc", 56);
+		sorted_keywords.push_back("bbc");
+		std::sort(sorted_keywords.begin(), sorted_keywords.end());
+		ac::trie t, u;
+		t.insert("bb");
+		u.insert("bb");
+		t.insert_sorted(keywords.begin(), keywords.end());
+		u.insert(keywords.begin(), keywords.end());
+		t.insert_sorted(sorted_keywords.begin(), sorted_keywords.end());
+		u.insert(sorted_keywords.begin(), sorted_keywords.end());
+		REQUIRE(u.num_keywords() == t.num_keywords());
+		for (auto const& text : random_strings(5, 100, 100, "abc", 57)) {
+			REQUIRE(same_emits(u, t, text));
+		}
+		REQUIRE(u.num_states() == t.num_states());
+	}
+	SECTION("failure states constructed in parallel") {
+		auto const keywords = random_strings(5000, 1, 8, "abcd", 29);
+		ac::trie serial;
+		serial.store_states_in_bfs_order();
+		serial.insert(keywords.begin(), keywords.end());
+		serial.check_postprocess();
+
+		ac::trie parallel;
+		parallel.store_states_in_bfs_order().thread_count(4);
+		parallel.insert(keywords.begin(), keywords.end());
+		parallel.check_postprocess();
+
+		auto const& serial_states = serial.get_states_in_bfs_order();
+		auto const& parallel_states = parallel.get_states_in_bfs_order();
+		REQUIRE(serial_states.size() == parallel_states.size());
+		for (size_t i = 1; i < serial_states.size(); ++i) {
+			REQUIRE(serial_states[i]->failure()->index() == parallel_states[i]->failure()->index());
+			REQUIRE(serial_states[i]->get_emits() == parallel_states[i]->get_emits());
+		}
+	}
+	SECTION("trie built in parallel") {
+		auto keywords = random_strings(5000, 1, 8, "abcdefgh", 30);
+		keywords.push_back("");
+		keywords.push_back("a");
+		keywords.push_back(keywords.front());
+		ac::trie serial;
+		serial.insert(keywords.begin(), keywords.end());
+
+		ac::trie parallel;
+		parallel.thread_count(4);
+		parallel.insert_parallel(keywords.begin(), keywords.end());
+		REQUIRE(serial.num_keywords() == parallel.num_keywords());
+
+		for (auto const& text : random_strings(5, 100, 100, "abcdefgh", 31)) {
+			auto expected = serial.parse_text(text);
+			auto emits = parallel.parse_text(text);
+			REQUIRE(expected.size() == emits.size());
+			for (size_t i = 0; i < emits.size(); ++i) {
+				check_emit(emits[i], expected[i].get_start(), expected[i].get_end(), expected[i].get_keyword());
+				REQUIRE(expected[i].get_index() == emits[i].get_index());
+			}
+		}
+	}
+	SECTION("trie built in parallel on top of existing keywords") {
+		auto const existing = random_strings(500, 1, 6, "abcd", 58);
+		auto keywords = random_strings(2000, 1, 8, "abcd", 59);
+		keywords.push_back("bbc");
+		keywords.push_back("ca");
+		ac::trie serial, parallel;
+		serial.insert("bb");
+		serial.insert(existing.begin(), existing.end());
+		parallel.insert("bb");
+		parallel.insert(existing.begin(), existing.end());
+		serial.insert(keywords.begin(), keywords.end());
+		parallel.thread_count(4);
+		parallel.insert_parallel(keywords.begin(), keywords.end());
+		REQUIRE(serial.num_keywords() == parallel.num_keywords());
+		for (auto const& text : random_strings(5, 100, 100, "abcd", 60)) {
+			REQUIRE(same_emits(serial, parallel, text));
+		}
+		REQUIRE(serial.num_states() == parallel.num_states());
+	}
+	SECTION("insert after the automaton has been constructed") {
+		auto const keywords = random_strings(600, 1, 6, "abc", 31);
+		auto const texts = random_strings(5, 200, 200, "abc", 32);
+		ac::trie incremental;
+		incremental.insert(keywords.begin(), keywords.begin() + 100);
+		incremental.parse_text(texts[0]);
+		for (size_t i = 100; i < keywords.size(); ++i) {
+			incremental.insert(keywords[i]);
+			if (i % 100 == 99) {
+				ac::trie rebuilt;
+				rebuilt.insert(keywords.begin(), keywords.begin() + i + 1);
+				for (auto const& text : texts) {
+					auto expected = rebuilt.parse_text(text);
+					auto emits = incremental.parse_text(text);
+					REQUIRE(expected.size() == emits.size());
+					bool same = true;
+					for (size_t j = 0; j < emits.size(); ++j) {
+						same = same && expected[j] == emits[j] && expected[j].get_index() == emits[j].get_index();
+					}
+					REQUIRE(same);
+				}
+			}
+		}
+	}
+	SECTION("insert after construction with states in BFS order") {
+		ac::trie t;
+		t.store_states_in_bfs_order();
+		t.insert("hers");
+		t.insert("his");
+		REQUIRE(1 == t.parse_text("ushers").size());
+		t.insert("she");
+		t.insert("he");
+		REQUIRE(3 == t.parse_text("ushers").size());
+		REQUIRE(t.num_states() == t.get_states_in_bfs_order().size());
+		REQUIRE(4 == t.get_final_states_in_bfs_order().size());
+	}
+	SECTION("erase keywords") {
+		ac::trie t;
+		t.insert("hers");
+		t.insert("his");
+		t.insert("she");
+		t.insert("he");
+		REQUIRE(3 == t.parse_text("ushers").size());
+		REQUIRE(10 == t.num_states());
+
+		REQUIRE(t.erase("hers"));
+		REQUIRE(!t.erase("hers"));
+		REQUIRE(!t.erase("h"));
+		REQUIRE(8 == t.num_states());
+		auto emits = t.parse_text("ushers");
+		REQUIRE(2 == emits.size());
+		check_emit(emits[0], 2, 3, "he");
+		check_emit(emits[1], 1, 3, "she");
+
+		REQUIRE(t.erase_by_index(3));
+		REQUIRE(!t.erase_by_index(3));
+		REQUIRE(7 == t.num_states());
+		emits = t.parse_text("ushers");
+		REQUIRE(1 == emits.size());
+		check_emit(emits[0], 1, 3, "she");
+	}
+	SECTION("erase keywords after the automaton has been constructed") {
+		auto const keywords = random_strings(300, 1, 6, "abc", 33);
+		auto const texts = random_strings(5, 200, 200, "abc", 34);
+		ac::trie t;
+		t.insert(keywords.begin(), keywords.end());
+		t.parse_text(texts[0]);
+
+		std::vector<bool> erased(keywords.size(), false);
+		for (size_t i = 0; i < keywords.size(); i += 2) {
+			if (i % 4 == 0) {
+				t.erase_by_index(i);
+				erased[i] = true;
+			} else if (t.erase(keywords[i])) {
+				for (size_t j = 0; j < keywords.size(); ++j) {
+					if (keywords[j] == keywords[i])
+						erased[j] = true;
+				}
+			}
+		}
+
+		ac::trie rebuilt;
+		for (size_t i = 0; i < keywords.size(); ++i) {
+			if (!erased[i])
+				rebuilt.insert(keywords[i]);
+		}
+		rebuilt.check_postprocess();
+		REQUIRE(rebuilt.num_states() == t.num_states());
+		for (auto const& text : texts) {
+			auto expected = rebuilt.parse_text(text);
+			auto emits = t.parse_text(text);
+			REQUIRE(expected.size() == emits.size());
+			bool same = true;
+			for (size_t j = 0; j < emits.size(); ++j) {
+				same = same && expected[j] == emits[j] && expected[j].get_keyword() == emits[j].get_keyword();
+			}
+			REQUIRE(same);
+		}
+	}
+	SECTION("cached transitions") {
+		auto const keywords = random_strings(300, 1, 6, "abc", 35);
+		auto const texts = random_strings(5, 200, 200, "abc", 36);
+		ac::trie plain;
+		plain.insert(keywords.begin(), keywords.end());
+		ac::trie cached;
+		cached.cache_transitions(1024);
+		cached.insert(keywords.begin(), keywords.end());
+
+		ac::trie::emit_collection expected, emits;
+		ac::trie::scratch s, t;
+		for (size_t round = 0; round < 2; ++round) {
+			for (auto const& text : texts) {
+				plain.parse_text(text, expected, s);
+				cached.parse_text(text, emits, t);
+				REQUIRE(expected.size() == emits.size());
+				bool same = true;
+				for (size_t j = 0; j < emits.size(); ++j) {
+					same = same && expected[j] == emits[j] && expected[j].get_index() == emits[j].get_index();
+				}
+				REQUIRE(same);
+			}
+			// The cached transitions must not outlive changes to the automaton.
+			plain.insert("cab");
+			plain.erase(keywords[0]);
+			cached.insert("cab");
+			cached.erase(keywords[0]);
+		}
+	}
+	SECTION("compiled automaton") {
+		auto keywords = random_strings(2000, 1, 8, "abcdefghijklmnopqrstuvwxyz", 37);
+		keywords.push_back("\xff\x80");
+		// Medium fanout with symbols in every word of a bitmap.
+		for (char c : std::string("\x01\x3f\x40\x7f\x80\xbf\xc0\xfe\xff")) {
+			keywords.push_back(std::string("\xfe") + c);
+		}
+		// Long keywords that share prefixes and suffixes become chains.
+		keywords.push_back("http://example.com/index.html");
+		keywords.push_back("http://example.org/");
+		keywords.push_back("example.com/robots.txt");
+		keywords.push_back("/index.htm");
+		auto texts = random_strings(5, 300, 300, "abcdefghijklmnopqrstuvwxyz", 38);
+		texts.push_back("x\xff\x80\xff\x80");
+		texts.push_back("\xfe\xfe\xff\xfe\x3f\xfe\x3e\xfe\xc0\xfe");
+		texts.push_back("http://example.com/index.htm http://example.com/robots.txt http://example.org/index.html http://exam");
+		ac::trie plain;
+		plain.insert(keywords.begin(), keywords.end());
+		ac::trie compiled;
+		compiled.insert(keywords.begin(), keywords.end());
+		compiled.compile();
+		REQUIRE(compiled.is_compiled());
+
+		auto const& stats = compiled.get_layout_statistics();
+		REQUIRE(compiled.num_states() == stats.state_count() + stats.collapsed_count());
+		REQUIRE(0 < stats.collapsed_count());
+		REQUIRE(ac::REPRESENTATION_DENSE == compiled.get_compiled_automaton().representation(0));
+		REQUIRE(0 < stats.count(ac::REPRESENTATION_SINGLE));
+		REQUIRE(0 < stats.count(ac::REPRESENTATION_SORTED));
+		REQUIRE(0 < stats.count(ac::REPRESENTATION_BITMAP));
+		REQUIRE(0 < stats.count(ac::REPRESENTATION_CHAIN));
+		// The letters, the bytes in the other keywords and one shared class.
+		REQUIRE(39 == stats.class_count());
+		size_t represented = 0;
+		for (int r = 0; r < ac::REPRESENTATION_COUNT; ++r) {
+			represented += stats.count(static_cast<ac::transition_representation>(r));
+		}
+		REQUIRE(stats.state_count() == represented);
+		for (auto const& text : texts) {
+			REQUIRE(same_emits(plain, compiled, text));
+		}
+
+		ac::trie budgeted;
+		budgeted.insert(keywords.begin(), keywords.end());
+		auto const budget = stats.bytes() - 1;
+		budgeted.compile(budget);
+		REQUIRE(budgeted.get_layout_statistics().bytes() <= budget);
+		REQUIRE(budgeted.get_layout_statistics().count(ac::REPRESENTATION_DENSE) < stats.count(ac::REPRESENTATION_DENSE));
+		for (auto const& text : texts) {
+			REQUIRE(same_emits(plain, budgeted, text));
+		}
+
+		// Updates discard the compiled automaton until the next parse.
+		compiled.insert("zzz");
+		plain.insert("zzz");
+		REQUIRE(!compiled.is_compiled());
+		REQUIRE(same_emits(plain, compiled, "azzzz"));
+		REQUIRE(compiled.is_compiled());
+
+		// Resetting the root discards the compiled automaton too.
+		compiled.reset_root();
+		plain.reset_root();
+		REQUIRE(!compiled.is_compiled());
+		REQUIRE(0 == compiled.num_states());
+		REQUIRE(compiled.parse_text("azzzz").empty());
+		compiled.insert("zz");
+		plain.insert("zz");
+		REQUIRE(same_emits(plain, compiled, "azzzz"));
+	}
+	SECTION("full DFA") {
+		auto keywords = random_strings(1000, 1, 8, "acgt", 39);
+		auto texts = random_strings(5, 300, 300, "acgtn", 40);
+		ac::trie plain;
+		plain.insert(keywords.begin(), keywords.end());
+		ac::trie dfa;
+		dfa.full_dfa().insert(keywords.begin(), keywords.end());
+		dfa.compile();
+
+		auto const& stats = dfa.get_layout_statistics();
+		REQUIRE(5 == stats.class_count());
+		REQUIRE(stats.state_count() == stats.count(ac::REPRESENTATION_DENSE));
+		REQUIRE(0 == stats.collapsed_count());
+		for (auto const& text : texts) {
+			REQUIRE(same_emits(plain, dfa, text));
+		}
+
+		ac::trie minimized;
+		minimized.full_dfa().minimize().insert(keywords.begin(), keywords.end());
+		minimized.compile();
+		auto const& minimized_stats = minimized.get_layout_statistics();
+		REQUIRE(0 < minimized_stats.shared_row_count());
+		auto const shared_bytes = minimized_stats.shared_row_count() * 5 * sizeof(uint32_t);
+		REQUIRE(minimized_stats.bytes() == stats.bytes() - shared_bytes);
+		for (auto const& text : texts) {
+			REQUIRE(same_emits(plain, minimized, text));
+		}
+	}
+	SECTION("skip symbols at the root") {
+		// One, a few and most symbols starting a keyword.
+		for (size_t count : {1, 5, 40}) {
+			ac::trie t;
+			t.case_insensitive();
+			for (size_t i = 0; i < count; ++i) {
+				t.insert(std::string(1, static_cast<char>(0x80 + i)) + "x");
+			}
+			std::string text(100, '.');
+			text[15] = static_cast<char>(0x80);
+			text[16] = 'X';
+			text[31] = static_cast<char>(0x80 + count - 1);
+			text[32] = 'x';
+			text.append("\x80");
+			auto emits = t.parse_text(text);
+			REQUIRE(2 == emits.size());
+			REQUIRE(15 == emits[0].get_start());
+			REQUIRE(31 == emits[1].get_start());
+		}
+	}
+	SECTION("teddy engine") {
+		auto keywords = random_strings(40, 1, 10, "abcdefgh:-", 41);
+		keywords.push_back("Content-Length");
+		keywords.push_back("content-type");
+		keywords.push_back("a");
+		keywords.push_back("a");
+		auto texts = random_strings(5, 500, 500, "abcdefghABCDEFGH:- ", 42);
+		texts.push_back("Content-Type: a; Content-Length: 3");
+		texts.push_back("");
+		for (int variant = 0; variant < 4; ++variant) {
+			ac::trie plain, teddy;
+			teddy.engine(ac::ENGINE_TEDDY);
+			if (variant == 1) {
+				plain.case_insensitive();
+				teddy.case_insensitive();
+			} else if (variant == 2) {
+				plain.only_whole_words();
+				teddy.only_whole_words();
+			} else if (variant == 3) {
+				plain.remove_overlaps();
+				teddy.remove_overlaps();
+			}
+			plain.insert(keywords.begin(), keywords.end());
+			teddy.insert(keywords.begin(), keywords.end());
+			for (auto const& text : texts) {
+				REQUIRE(same_emits(plain, teddy, text));
+			}
+#if defined(AHO_CORASICK_HAS_SSSE3_TARGET)
+			REQUIRE(ac::ENGINE_TEDDY == teddy.active_engine());
+#endif
+			// The engine follows updates to the automaton.
+			plain.insert("ab:");
+			teddy.insert("ab:");
+			plain.erase(keywords[0]);
+			teddy.erase(keywords[0]);
+			for (auto const& text : texts) {
+				REQUIRE(same_emits(plain, teddy, text));
+			}
+		}
+
+		// Too many keywords for the engine.
+		auto many = random_strings(200, 2, 6, "abc", 43);
+		ac::trie fallback;
+		fallback.engine(ac::ENGINE_TEDDY).insert(many.begin(), many.end());
+		fallback.parse_text("abc");
+		REQUIRE(ac::ENGINE_AUTOMATON == fallback.active_engine());
+	}
+	SECTION("shift-or engine") {
+		std::vector<std::string> keywords = { "he", "she", "his", "hers", "She", "he", "s" };
+		auto texts = random_strings(20, 0, 100, "ehirsS ", 44);
+		texts.push_back("ushers");
+		for (int variant = 0; variant < 3; ++variant) {
+			ac::trie plain, shift_or;
+			shift_or.engine(ac::ENGINE_SHIFT_OR);
+			if (variant == 1) {
+				plain.case_insensitive();
+				shift_or.case_insensitive();
+			} else if (variant == 2) {
+				plain.only_whole_words().remove_overlaps();
+				shift_or.only_whole_words().remove_overlaps();
+			}
+			plain.insert(keywords.begin(), keywords.end());
+			shift_or.insert(keywords.begin(), keywords.end());
+			for (auto const& text : texts) {
+				REQUIRE(same_emits(plain, shift_or, text));
+			}
+			REQUIRE(ac::ENGINE_SHIFT_OR == shift_or.active_engine());
+		}
+
+		// Automatic selection by size.
+		ac::trie t;
+		t.engine(ac::ENGINE_AUTO).insert(keywords.begin(), keywords.end());
+		t.parse_text("");
+		REQUIRE(ac::ENGINE_SHIFT_OR == t.active_engine());
+		t.insert(std::string(60, 'x'));
+		t.parse_text("");
+		REQUIRE(ac::ENGINE_SHIFT_OR != t.active_engine());
+	}
+	SECTION("fixed length engine") {
+		for (size_t length : {1, 3, 8, 9, 16}) {
+			auto keywords = random_strings(500, length, length, "abcD", 45);
+			keywords.push_back(keywords.front());
+			auto texts = random_strings(5, 0, 300, "abcdABCD", 46);
+			for (int variant = 0; variant < 2; ++variant) {
+				ac::trie plain, fixed;
+				fixed.engine(ac::ENGINE_FIXED_LENGTH);
+				if (variant == 1) {
+					plain.case_insensitive();
+					fixed.case_insensitive();
+				}
+				plain.insert(keywords.begin(), keywords.end());
+				fixed.insert(keywords.begin(), keywords.end());
+				for (auto const& text : texts) {
+					REQUIRE(same_emits(plain, fixed, text));
+				}
+				REQUIRE(ac::ENGINE_FIXED_LENGTH == fixed.active_engine());
+			}
+		}
+
+		// Keywords of different lengths.
+		ac::trie t;
+		t.engine(ac::ENGINE_FIXED_LENGTH);
+		t.insert("abc");
+		t.insert("abcd");
+		REQUIRE(2 == t.parse_text("abcd").size());
+		REQUIRE(ac::ENGINE_AUTOMATON == t.active_engine());
+	}
+	SECTION("wu-manber engine") {
+		auto keywords = random_strings(300, 16, 40, "abcd", 47);
+		keywords.push_back(keywords.front().substr(0, 20));
+		keywords.push_back(keywords.front());
+		auto texts = random_strings(5, 0, 2000, "abcdABCD", 48);
+		// Keywords overlapping each other and ending at the same position.
+		texts.push_back(keywords.front() + keywords.front());
+		for (int variant = 0; variant < 2; ++variant) {
+			ac::trie plain, wu_manber;
+			wu_manber.engine(ac::ENGINE_AUTO);
+			if (variant == 1) {
+				plain.case_insensitive();
+				wu_manber.case_insensitive();
+			}
+			plain.insert(keywords.begin(), keywords.end());
+			wu_manber.insert(keywords.begin(), keywords.end());
+			for (auto const& text : texts) {
+				REQUIRE(same_emits(plain, wu_manber, text));
+			}
+			REQUIRE(ac::ENGINE_WU_MANBER == wu_manber.active_engine());
+		}
+
+		// Too short for automatic selection, but still usable.
+		std::vector<std::string> short_keywords = { "abc", "bcd", "abcd" };
+		ac::trie plain, t;
+		plain.insert(short_keywords.begin(), short_keywords.end());
+		t.engine(ac::ENGINE_WU_MANBER).insert(short_keywords.begin(), short_keywords.end());
+		for (auto const& text : texts) {
+			REQUIRE(same_emits(plain, t, text));
+		}
+		REQUIRE(ac::ENGINE_WU_MANBER == t.active_engine());
+	}
+	SECTION("long keywords") {
+		auto keywords = random_strings(200, 4, 40, "abcd", 49);
+		keywords.push_back(keywords.back().substr(0, 8));
+		keywords.push_back(keywords.back() + "abab");
+		auto texts = random_strings(5, 0, 2000, "abcdABCD", 50);
+		texts.push_back(keywords.back() + keywords.back());
+		for (int variant = 0; variant < 4; ++variant) {
+			ac::trie plain, hybrid;
+			hybrid.long_keyword_threshold(8);
+			if (variant & 1) {
+				plain.case_insensitive();
+				hybrid.case_insensitive();
+			}
+			if (variant & 2) {
+				hybrid.compile().engine(ac::ENGINE_AUTO);
+			}
+			plain.insert(keywords.begin(), keywords.end());
+			hybrid.insert(keywords.begin(), keywords.end());
+			for (auto const& text : texts) {
+				REQUIRE(same_emits(plain, hybrid, text));
+			}
+			REQUIRE(hybrid.num_states() < plain.num_states());
+		}
+
+		ac::trie t;
+		t.long_keyword_threshold(3).remove_overlaps();
+		t.insert("abcdef");
+		t.insert("abc");
+		t.insert("abcxyz");
+		auto emits = t.parse_text("abcdefabcxyzabc");
+		REQUIRE(3 == emits.size());
+		auto it = emits.begin();
+		check_emit(*it++, 0, 5, "abcdef");
+		check_emit(*it++, 6, 11, "abcxyz");
+		check_emit(*it++, 12, 14, "abc");
+
+		// Erasing a long keyword keeps the keyword that is its prefix.
+		REQUIRE(t.erase("abcdef"));
+		REQUIRE_FALSE(t.erase("abcdef"));
+		emits = t.parse_text("abcdef");
+		REQUIRE(1 == emits.size());
+		check_emit(emits.front(), 0, 2, "abc");
+		REQUIRE(t.erase("abc"));
+		emits = t.parse_text("abcxyz");
+		REQUIRE(1 == emits.size());
+		check_emit(emits.front(), 0, 5, "abcxyz");
+
+		// The indexed prefix of a long keyword was never inserted.
+		ac::trie prefixed;
+		prefixed.long_keyword_threshold(2);
+		prefixed.insert("abcd");
+		REQUIRE_FALSE(prefixed.erase("ab"));
+		emits = prefixed.parse_text("xabcd");
+		REQUIRE(1 == emits.size());
+		check_emit(emits.front(), 1, 4, "abcd");
+	}
+	SECTION("factor engine") {
+		auto keywords = random_strings(2000, 1, 20, "abcdefgh", 53);
+		keywords.push_back(keywords.front());
+		auto texts = random_strings(5, 0, 2000, "abcdefghABCDEFGH", 54);
+		texts.push_back(keywords[1] + keywords[2] + keywords[1]);
+		for (int variant = 0; variant < 2; ++variant) {
+			ac::trie plain, factor;
+			factor.engine(ac::ENGINE_FACTOR);
+			if (variant == 1) {
+				plain.case_insensitive();
+				factor.case_insensitive();
+			}
+			plain.insert(keywords.begin(), keywords.end());
+			factor.insert(keywords.begin(), keywords.end());
+			for (auto const& text : texts) {
+				REQUIRE(same_emits(plain, factor, text));
+			}
+			REQUIRE(ac::ENGINE_FACTOR == factor.active_engine());
+		}
+
+		// The anchor search reuses the caller's scratch.
+		ac::trie t;
+		t.engine(ac::ENGINE_FACTOR);
+		t.insert(keywords.begin(), keywords.end());
+		ac::trie::emit_collection emits;
+		ac::trie::scratch s;
+		std::string const text = keywords[3] + " " + keywords[4];
+		t.parse_text(text, emits, s);
+		auto const before = allocation_count.load();
+		t.parse_text(text, emits, s);
+		auto const allocations = allocation_count.load() - before;
+		REQUIRE(2 <= emits.size());
+		REQUIRE(0 == allocations);
+
+		ac::wtrie plain, factor;
+		factor.engine(ac::ENGINE_FACTOR);
+		for (auto const& keyword : { L"\u00e9t\u00e9", L"t\u00e9l\u00e9phone", L"phone" }) {
+			plain.insert(keyword);
+			factor.insert(keyword);
+		}
+		REQUIRE(same_emits(plain, factor, std::wstring(L"un t\u00e9l\u00e9phone en \u00e9t\u00e9")));
+		REQUIRE(ac::ENGINE_FACTOR == factor.active_engine());
+	}
+	SECTION("parse after reset_root with each engine") {
+		for (int e = ac::ENGINE_AUTOMATON; e <= ac::ENGINE_AUTO; ++e) {
+			for (int variant = 0; variant < 2; ++variant) {
+				ac::trie t;
+				t.engine(static_cast<ac::search_engine>(e));
+				if (variant == 1)
+					t.qgram_filter().long_keyword_threshold(3);
+				t.insert("abcd");
+				t.insert("bcde");
+				REQUIRE(2 == t.parse_text("xabcdex").size());
+				t.reset_root();
+				REQUIRE(t.parse_text("xabcdex").empty());
+				t.insert("cdef");
+				auto emits = t.parse_text("xabcdefx");
+				REQUIRE(1 == emits.size());
+				check_emit(emits.front(), 3, 6, "cdef");
+			}
+		}
+	}
+	SECTION("q-gram filter") {
+		auto keywords = random_strings(100, 3, 12, "abcdefgh", 51);
+		keywords.push_back(keywords.front() + "abcdefghijklmnop");
+		auto texts = random_strings(10, 0, 2000, "abcdefghijklmnopqrstuvwxyzABCDEFGH", 52);
+		for (size_t i = 0; i < keywords.size(); i += 7)
+			texts.push_back(texts[i % 10] + keywords[i] + keywords[i + 1] + texts[(i + 1) % 10]);
+		texts.push_back(keywords.back());
+		for (int variant = 0; variant < 8; ++variant) {
+			ac::trie plain, filtered;
+			filtered.qgram_filter();
+			if (variant & 1) {
+				plain.case_insensitive();
+				filtered.case_insensitive();
+			}
+			if (variant & 2) {
+				filtered.compile();
+			}
+			if (variant & 4) {
+				filtered.long_keyword_threshold(6).only_whole_words();
+				plain.only_whole_words();
+			}
+			plain.insert(keywords.begin(), keywords.end());
+			filtered.insert(keywords.begin(), keywords.end());
+			for (auto const& text : texts) {
+				REQUIRE(same_emits(plain, filtered, text));
+			}
+			// Updates rebuild the filter.
+			plain.insert("zzz");
+			filtered.insert("zzz");
+			REQUIRE(same_emits(plain, filtered, texts.front() + "zzzz"));
+		}
+	}
+	SECTION("compiled wtrie") {
+		ac::wtrie t;
+		t.case_insensitive().compile();
+		t.insert(L"turning");
+		t.insert(L"once");
+		t.insert(L"\u00e9t\u00e9");
+
+		auto emits = t.parse_text(L"TurninG OnCe \u00e9t\u00e9");
+		REQUIRE(t.is_compiled());
+		REQUIRE(0 == t.get_layout_statistics().count(ac::REPRESENTATION_DENSE));
+		REQUIRE(3 == emits.size());
+
+		auto it = emits.begin();
+		check_wemit(*it++, 0, 6, L"turning");
+		check_wemit(*it++, 8, 11, L"once");
+		check_wemit(*it++, 13, 15, L"\u00e9t\u00e9");
+	}
+	SECTION("unicode case folding") {
+		REQUIRE(0x3c3 == ac::fold_code_point(0x3a3));
+		REQUIRE(0x3c3 == ac::fold_code_point(0x3c2));
+		REQUIRE(0xdf == ac::fold_code_point(0x1e9e));
+		REQUIRE(0x6b == ac::fold_code_point(0x212a));
+		REQUIRE(0x130 == ac::fold_code_point(0x130));
+		REQUIRE(0x10428 == ac::fold_code_point(0x10400));
+		REQUIRE(0xd800 == ac::fold_code_point(0xd800));
+		REQUIRE(0x110000 == ac::fold_code_point(0x110000));
+
+		for (int variant = 0; variant < 2; ++variant) {
+			ac::wtrie t;
+			t.case_insensitive();
+			if (variant == 1)
+				t.compile();
+			t.insert(L"Stra\u00dfe");
+			t.insert(L"\u03a3\u039f\u03a6\u0399\u0391");
+			t.insert(L"\u043f\u0440\u0438\u0432\u0435\u0442");
+
+			auto emits = t.parse_text(L"STRA\u1e9eE \u03c3\u03bf\u03c6\u03b9\u03b1 \u041f\u0420\u0418\u0412\u0415\u0422 STRASSE");
+			REQUIRE(3 == emits.size());
+			auto it = emits.begin();
+			check_wemit(*it++, 0, 5, L"stra\u00dfe");
+			check_wemit(*it++, 7, 11, L"\u03c3\u03bf\u03c6\u03b9\u03b1");
+			check_wemit(*it++, 13, 18, L"\u043f\u0440\u0438\u0432\u0435\u0442");
+			REQUIRE(t.erase(L"\u041f\u0420\u0418\u0412\u0415\u0422"));
+			REQUIRE(2 == t.parse_text(L"STRA\u1e9eE \u03c3\u03bf\u03c6\u03b9\u03b1 \u041f\u0420\u0418\u0412\u0415\u0422").size());
+		}
+
+		ac::trie narrow;
+		narrow.case_insensitive();
+		narrow.insert("Hers");
+		auto emits = narrow.parse_text("HERS hers");
+		REQUIRE(2 == emits.size());
+		check_emit(emits.front(), 0, 3, "hers");
+	}
+	SECTION("utf-8 trie") {
+		ac::utf8_trie t;
+		t.insert(U"\u00e9t\u00e9");
+		t.insert(L"caf\u00e9");
+		t.insert(std::string("\xf0\x9f\x98\x80"));
+
+		std::string text("un caf\xc3\xa9 en \xc3\xa9t\xc3\xa9 \xf0\x9f\x98\x80 \xff");
+		auto emits = t.parse_text(text);
+		REQUIRE(3 == emits.size());
+		check_emit(emits[0], 3, 7, "caf\xc3\xa9");
+		check_emit(emits[1], 12, 16, "\xc3\xa9t\xc3\xa9");
+		check_emit(emits[2], 18, 21, "\xf0\x9f\x98\x80");
+		ac::utf8_trie::to_code_point_offsets(text, emits);
+		check_emit(emits[0], 3, 6, "caf\xc3\xa9");
+		check_emit(emits[1], 11, 13, "\xc3\xa9t\xc3\xa9");
+		check_emit(emits[2], 15, 15, "\xf0\x9f\x98\x80");
+
+		for (int variant = 0; variant < 2; ++variant) {
+			ac::utf8_trie ci;
+			ci.case_insensitive();
+			if (variant == 1)
+				ci.compile();
+			ci.insert(U"kelvin");
+			ci.insert(U"\u03a3\u039f\u03a6\u0399\u0391");
+			ci.insert(std::string("STRASSE"));
+
+			// The Kelvin sign and the sharp s fold to shorter sequences.
+			std::string mixed("\xe2\x84\xaa" "ELVIN \xe1\xba\x9e \xcf\x83\xce\xbf\xcf\x86\xce\xb9\xce\xb1 strasse");
+			ac::utf8_trie::scratch s;
+			ac::utf8_trie::emit_collection folded_emits;
+			ci.parse_text(mixed, folded_emits, s);
+			REQUIRE(3 == folded_emits.size());
+			check_emit(folded_emits[0], 0, 7, "kelvin");
+			check_emit(folded_emits[1], 13, 22, "\xcf\x83\xce\xbf\xcf\x86\xce\xb9\xce\xb1");
+			check_emit(folded_emits[2], 24, 30, "strasse");
+			REQUIRE(ci.erase(U"KELVIN"));
+			ci.parse_text(mixed, folded_emits, s);
+			REQUIRE(2 == folded_emits.size());
+		}
+	}
+	SECTION("utf-8 trie with whole words next to non-ascii letters") {
+		ac::utf8_trie t;
+		t.only_whole_words();
+		t.insert(std::string("caf"));
+		t.insert(std::string("ete"));
+		t.insert(U"\u6771\u4eac");
+
+		// "café", "été" spelt with accents, "ete" between dashes and a
+		// Cyrillic letter, then "東京" quoted in CJK brackets.
+		std::string text("caf\xc3\xa9 \xc3\xa9tete \xe2\x80\x94" "ete\xe2\x80\x94 ete\xd0\xb6 \xe3\x80\x8c\xe6\x9d\xb1\xe4\xba\xac\xe3\x80\x8d caf");
+		auto emits = t.parse_text(text);
+		REQUIRE(3 == emits.size());
+		check_emit(emits[0], 16, 18, "ete");
+		check_emit(emits[1], 32, 37, "\xe6\x9d\xb1\xe4\xba\xac");
+		check_emit(emits[2], 42, 44, "caf");
+
+		ac::utf8_trie ci;
+		ci.case_insensitive().only_whole_words().engine(ac::ENGINE_AUTO);
+		ci.insert(U"elvin");
+		ci.insert(U"strasse");
+		// Accented letters next to the keywords; the capital sharp s folds to
+		// a shorter sequence and shifts the offsets of the folded text.
+		std::string mixed("\xc3\x84" "ELVIN \xe1\xba\x9e STRASSE\xc3\x9f");
+		auto folded_emits = ci.parse_text(mixed);
+		REQUIRE(folded_emits.empty());
+		folded_emits = ci.parse_text(std::string("\xe1\xba\x9e strasse \xc2\xbb elvin"));
+		REQUIRE(2 == folded_emits.size());
+		check_emit(folded_emits[0], 4, 10, "strasse");
+		check_emit(folded_emits[1], 15, 19, "elvin");
+	}
+	SECTION("utf-16 and utf-32 tries") {
+		ac::u16trie t16;
+		ac::u32trie t32;
+		t16.case_insensitive().only_whole_words();
+		t32.case_insensitive().only_whole_words();
+		t16.insert(u"\u6771\u4eac");
+		t16.insert(u"\u0394\u03b5\u03bb\u03c4\u03b1");
+		t32.insert(U"\U0001F600\u6771\u4eac");
+		t32.insert(U"\u0394\u03b5\u03bb\u03c4\u03b1");
+
+		auto emits16 = t16.parse_text(u"\u6771\u4eac \u03b4\u0395\u039b\u03a4\u0391 x\u03b4\u03b5\u03bb\u03c4\u03b1");
+		REQUIRE(2 == emits16.size());
+		REQUIRE(0 == emits16[0].get_start());
+		REQUIRE(1 == emits16[0].get_end());
+		REQUIRE(3 == emits16[1].get_start());
+		REQUIRE(u"\u03b4\u03b5\u03bb\u03c4\u03b1" == emits16[1].get_keyword());
+		auto emits32 = t32.parse_text(U"a \U0001F600\u6771\u4eac \u0394\u0395\u039b\u03a4\u0391");
+		REQUIRE(2 == emits32.size());
+		REQUIRE(2 == emits32[0].get_start());
+		REQUIRE(4 == emits32[0].get_end());
+
+		// Letters outside the Basic Multilingual Plane fold as code points.
+		ac::u32trie deseret;
+		deseret.case_insensitive();
+		deseret.insert(U"\U00010400\U00010401");
+		auto deseret_emits = deseret.parse_text(U"\U00010428\U00010401 \U0001E900\U0001E922");
+		REQUIRE(1 == deseret_emits.size());
+		REQUIRE(U"\U00010428\U00010429" == deseret_emits[0].get_keyword());
+
+		// Many transitions from one state, with erasures in between.
+		std::vector<std::u32string> keywords;
+		for (char32_t c = 0x4e00; c < 0x4e00 + 3000; c += 3)
+			keywords.push_back(std::u32string(1, c) + U"\u3002");
+		ac::u32trie wide;
+		ac::basic_trie<char32_t> mapped;
+		wide.insert(keywords.begin(), keywords.end());
+		mapped.insert(keywords.begin(), keywords.end());
+		for (size_t i = 0; i < keywords.size(); i += 5) {
+			REQUIRE(wide.erase(keywords[i]));
+			REQUIRE(mapped.erase(keywords[i]));
+		}
+		std::u32string text;
+		for (char32_t c = 0x4e00; c < 0x4e00 + 3000; ++c)
+			text += std::u32string(1, c) + U"\u3002";
+		REQUIRE(same_emits(mapped, wide, text));
+		REQUIRE(mapped.num_states() == wide.num_states());
+		wide.compile();
+		mapped.compile();
+		REQUIRE(same_emits(mapped, wide, text));
+	}
 	SECTION("misleading test") {
 		ac::trie t;
 		t.insert("hers");
@@ -140,6 +1036,101 @@ TEST_CASE("trie works as required", "[trie]") {
 		check_emit(*it++, 0, 4, "ababc");
 		check_emit(*it++, 6, 7, "ab");
 	}
+	SECTION("non overlapping with reused buffers") {
+		ac::trie t;
+		t.remove_overlaps();
+		t.insert("ab");
+		t.insert("cba");
+		t.insert("ababc");
+
+		ac::trie::emit_collection emits;
+		ac::trie::scratch s;
+		t.parse_text("ababcbab", emits, s);
+		REQUIRE(2 == emits.size());
+		auto const capacity = emits.capacity();
+		auto const data = emits.data();
+
+		t.parse_text("ababcbab", emits, s);
+		REQUIRE(2 == emits.size());
+		REQUIRE(capacity == emits.capacity());
+		REQUIRE(data == emits.data());
+
+		auto it = emits.begin();
+		check_emit(*it++, 0, 4, "ababc");
+		check_emit(*it++, 6, 7, "ab");
+
+		t.parse_text("cba", emits, s);
+		REQUIRE(1 == emits.size());
+		check_emit(emits.front(), 0, 2, "cba");
+	}
+	SECTION("parse without allocating besides emits") {
+		std::string const long_keyword(40, 'k');
+		ac::trie t;
+		t.remove_overlaps();
+		t.insert("ab");
+		t.insert("cba");
+		t.insert("ababc");
+		t.insert(long_keyword);
+		std::string const text = "ababcbab " + long_keyword + " cba " + long_keyword;
+
+		ac::trie::emit_collection emits;
+		ac::trie::scratch s;
+		t.parse_text(text, emits, s);
+		REQUIRE(5 == emits.size());
+
+		// Keywords that fit in the string's small buffer are not allocated;
+		// each emit of the long keyword allocates its copy.
+		// Catch allocates, so count before checking anything.
+		auto const before = allocation_count.load();
+		t.parse_text(text, emits, s);
+		auto const allocations = allocation_count.load() - before;
+		REQUIRE(5 == emits.size());
+		REQUIRE(2 == allocations);
+
+		std::string const short_text = "ababcbab cba";
+		auto const short_before = allocation_count.load();
+		t.parse_text(short_text, emits, s);
+		auto const short_allocations = allocation_count.load() - short_before;
+		REQUIRE(3 == emits.size());
+		REQUIRE(0 == short_allocations);
+	}
+	SECTION("trie with a custom allocator") {
+		typedef ac::basic_trie<char, ac::transition_map, counting_allocator<char>> counting_trie;
+		size_t bytes = 0;
+		{
+			counting_trie t{counting_allocator<char>(&bytes)};
+			auto const empty_size = bytes;
+			REQUIRE(0 < empty_size);
+			t.insert("hers");
+			t.insert("his");
+			t.insert("she");
+			t.insert("a keyword that does not fit in the small string buffer");
+			REQUIRE(empty_size < bytes);
+
+			auto emits = t.parse_text("ushers");
+			REQUIRE(2 == emits.size());
+			auto it = emits.begin();
+			check_emit(*it++, 1, 3, "she");
+			check_emit(*it++, 2, 5, "hers");
+		}
+		REQUIRE(0 == bytes);
+
+		// Long keywords are stored with the trie's allocator too.
+		{
+			counting_trie t{counting_allocator<char>(&bytes)};
+			t.long_keyword_threshold(8);
+			auto const empty_size = bytes;
+			std::string const keyword(5000, 'a');
+			t.insert(keyword);
+			auto const keyword_bytes = bytes - empty_size;
+			REQUIRE(keyword.size() < keyword_bytes);
+			auto emits = t.parse_text(keyword);
+			REQUIRE(1 == emits.size());
+			REQUIRE(keyword == emits.front().get_keyword());
+			REQUIRE(t.erase(keyword));
+		}
+		REQUIRE(0 == bytes);
+	}
 	SECTION("partial match") {
 		ac::trie t;
 		t.only_whole_words();